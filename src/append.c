@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Append fast path
+ *
+ * Time-series keys mostly arrive in increasing order. The handle caches the
+ * nodes on the path from the root to the rightmost leaf, so a key at or
+ * above the current maximum is appended to that leaf without reading the
+ * tree. A full node on the right edge is split full-left: it keeps all but
+ * its last entry, which moves up, and a new right sibling starts with the
+ * new entry. Nodes left behind the right edge therefore stay full instead
+ * of half empty.
+ */
+
+// deepest tree whose right edge can be cached
+#define APPEND_MAX_DEPTH 32
+
+// helper to read the path from the root to the rightmost leaf
+static void load_right_path(BTree *t) {
+    if (!t->right_path) {
+        t->right_path = malloc(APPEND_MAX_DEPTH * sizeof(BTNode));
+        if (!t->right_path) die("malloc");
+    }
+
+    uint64_t id = t->hdr.root_block;
+    int depth = 0;
+    while (1) {
+        if (depth == APPEND_MAX_DEPTH) die("tree too deep");
+        BTNode *node = &t->right_path[depth++];
+        read_node(t, id, node);
+        if (node->children[0] == 0) break;
+        id = node->children[node->n];
+    }
+    t->right_depth = depth;
+
+    // the largest key is the last one of the rightmost leaf (0 if empty)
+    BTNode *leaf = &t->right_path[depth - 1];
+    t->max_key = leaf->n > 0 ? leaf->keys[leaf->n - 1] : 0;
+    t->max_known = 1;
+}
+
+// helper to add an entry at the end of the right edge
+static void append_entry(BTree *t, uint64_t key, uint64_t value) {
+    int level = t->right_depth - 1;
+    BTNode *leaf = &t->right_path[level];
+
+    // common case: the leaf has room
+    if (leaf->n < t->max_keys) {
+        leaf->keys[leaf->n] = key;
+        leaf->values[leaf->n] = value;
+        leaf->n++;
+        write_node(t, leaf->block_id, leaf);
+        return;
+    }
+
+    // full-left split: the last entry of the leaf moves up, a new leaf takes the key
+    uint64_t up_key = leaf->keys[leaf->n - 1];
+    uint64_t up_value = leaf->values[leaf->n - 1];
+    leaf->keys[leaf->n - 1] = 0;
+    leaf->values[leaf->n - 1] = 0;
+    leaf->n--;
+
+    BTNode right;
+    memset(&right, 0, sizeof(right));
+    right.block_id = alloc_node(t);
+    right.keys[0] = key;
+    right.values[0] = value;
+    right.n = 1;
+
+    // carry (up_key, right) up the right edge until a node has room
+    for (level--; level >= 0; level--) {
+        BTNode *node = &t->right_path[level];
+        BTNode *left = &t->right_path[level + 1];
+
+        if (node->n < t->max_keys) {
+            node->keys[node->n] = up_key;
+            node->values[node->n] = up_value;
+            node->children[node->n + 1] = right.block_id;
+            node->n++;
+            right.parent_id = node->block_id;
+
+            BTNode *dirty[3] = { left, &right, node };
+            write_nodes(t, dirty, 3);
+            *left = right;
+            return;
+        }
+
+        // split the internal node full-left too: its last child moves to the new node
+        BTNode parent_right;
+        memset(&parent_right, 0, sizeof(parent_right));
+        parent_right.block_id = alloc_node(t);
+        parent_right.keys[0] = up_key;
+        parent_right.values[0] = up_value;
+        parent_right.children[0] = node->children[node->n];
+        parent_right.children[1] = right.block_id;
+        parent_right.n = 1;
+
+        up_key = node->keys[node->n - 1];
+        up_value = node->values[node->n - 1];
+        node->keys[node->n - 1] = 0;
+        node->values[node->n - 1] = 0;
+        node->children[node->n] = 0;
+        node->n--;
+
+        // the moved child is the node cached one level down
+        left->parent_id = parent_right.block_id;
+        right.parent_id = parent_right.block_id;
+        BTNode *dirty[2] = { left, &right };
+        write_nodes(t, dirty, 2);
+        *left = right;
+        right = parent_right;
+    }
+
+    // the root was full as well: put a new root above it
+    if (t->right_depth == APPEND_MAX_DEPTH) die("tree too deep");
+    BTNode *old_root = &t->right_path[0];
+    BTNode new_root;
+    memset(&new_root, 0, sizeof(new_root));
+    new_root.block_id = alloc_node(t);
+    new_root.keys[0] = up_key;
+    new_root.values[0] = up_value;
+    new_root.children[0] = old_root->block_id;
+    new_root.children[1] = right.block_id;
+    new_root.n = 1;
+    old_root->parent_id = new_root.block_id;
+    right.parent_id = new_root.block_id;
+
+    BTNode *dirty[3] = { old_root, &right, &new_root };
+    write_nodes(t, dirty, 3);
+    t->hdr.root_block = new_root.block_id;
+
+    // the cached edge grows by one level
+    memmove(&t->right_path[1], &t->right_path[0], t->right_depth * sizeof(BTNode));
+    t->right_path[0] = new_root;
+    t->right_path[1] = right;
+    t->right_depth++;
+}
+
+void append_forget(BTree *t) {
+    t->right_depth = 0;
+    t->max_known = 0;
+}
+
+int append_insert(BTree *t, uint64_t key, uint64_t value) {
+    // counted nodes would need every ancestor rewritten anyway
+    if (t->hdr.flags & BT_FLAG_COUNTED) return 0;
+
+    // the maximum is learned once per handle
+    if (!t->max_known) load_right_path(t);
+
+    // anything else takes the normal path, which may change the right edge
+    // but never the maximum
+    if (key < t->max_key) {
+        t->right_depth = 0;
+        return 0;
+    }
+
+    // a fresh right edge may hold a larger key than the one remembered
+    if (t->right_depth == 0) {
+        load_right_path(t);
+        if (key < t->max_key) {
+            t->right_depth = 0;
+            return 0;
+        }
+    }
+    append_entry(t, key, value);
+    t->max_key = key;
+
+    // the nodes above the leaf learn that their subtree changed (once per
+    // generation, the cached copies remember it)
+    for (int level = 0; level < t->right_depth - 1; level++) touch_node(t, &t->right_path[level]);
+    return 1;
+}
@@ -0,0 +1,282 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Batch merge
+ *
+ * A batch is sorted and then merged into the tree in one depth-first walk.
+ * Each internal node splits its part of the batch between the children it
+ * touches, reads those children in one I/O batch and merges into each of
+ * them. A node that ends up with too many entries is cut into as few nodes
+ * as possible, and the entries between the pieces move up into the parent,
+ * which may in turn be cut. Every touched node is read and written once
+ * per batch, instead of once per key.
+ */
+
+// pair of the batch, with its position to keep duplicates in input order
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    size_t   seq;
+} BatchPair;
+
+// entries and children of a node being rebuilt, in key order
+typedef struct {
+    uint64_t *keys;
+    uint64_t *values;
+    uint64_t *children;     // n + 1 entries for internal nodes
+    uint64_t *counts;       // subtree size below each child
+    size_t    n;
+    size_t    nchildren;
+    size_t    cap;
+} Run;
+
+// nodes a merged node was cut into, as seen by its parent
+typedef struct {
+    uint64_t  first_count;  // subtree size left below the original node
+    uint64_t *keys;         // entry moved up before each new node
+    uint64_t *values;
+    uint64_t *ids;          // new right siblings, in key order
+    uint64_t *counts;       // their subtree sizes
+    size_t    n;
+    size_t    cap;
+} Spill;
+
+// helper to grow a run so it can take one more entry and child
+static void run_reserve(Run *run) {
+    if (run->n < run->cap && run->nchildren < run->cap) return;
+    run->cap = run->cap ? run->cap * 2 : 64;
+    run->keys = realloc(run->keys, run->cap * sizeof(uint64_t));
+    run->values = realloc(run->values, run->cap * sizeof(uint64_t));
+    run->children = realloc(run->children, run->cap * sizeof(uint64_t));
+    run->counts = realloc(run->counts, run->cap * sizeof(uint64_t));
+    if (!run->keys || !run->values || !run->children || !run->counts) die("realloc");
+}
+
+// helper to append an entry to a run
+static void run_push_entry(Run *run, uint64_t key, uint64_t value) {
+    run_reserve(run);
+    run->keys[run->n] = key;
+    run->values[run->n] = value;
+    run->n++;
+}
+
+// helper to append a child to a run
+static void run_push_child(Run *run, uint64_t id, uint64_t count) {
+    run_reserve(run);
+    run->children[run->nchildren] = id;
+    run->counts[run->nchildren] = count;
+    run->nchildren++;
+}
+
+// helper to release a run
+static void run_free(Run *run) {
+    free(run->keys);
+    free(run->values);
+    free(run->children);
+    free(run->counts);
+}
+
+// helper to record a new right sibling and the entry in front of it
+static void spill_push(Spill *spill, uint64_t key, uint64_t value, uint64_t id, uint64_t count) {
+    if (spill->n == spill->cap) {
+        spill->cap = spill->cap ? spill->cap * 2 : 16;
+        spill->keys = realloc(spill->keys, spill->cap * sizeof(uint64_t));
+        spill->values = realloc(spill->values, spill->cap * sizeof(uint64_t));
+        spill->ids = realloc(spill->ids, spill->cap * sizeof(uint64_t));
+        spill->counts = realloc(spill->counts, spill->cap * sizeof(uint64_t));
+        if (!spill->keys || !spill->values || !spill->ids || !spill->counts) die("realloc");
+    }
+    spill->keys[spill->n] = key;
+    spill->values[spill->n] = value;
+    spill->ids[spill->n] = id;
+    spill->counts[spill->n] = count;
+    spill->n++;
+}
+
+// helper to release a spill
+static void spill_free(Spill *spill) {
+    free(spill->keys);
+    free(spill->values);
+    free(spill->ids);
+    free(spill->counts);
+}
+
+// helper to order batch pairs by key, then by input position
+static int compare_pairs(const void *a, const void *b) {
+    const BatchPair *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+// helper to write a run as the original node plus as many new right
+// siblings as it needs, reporting the siblings to the parent
+static void emit_nodes(BTree *t, const BTNode *orig, const Run *run, Spill *out) {
+    int leaf = run->nchildren == 0;
+    size_t max_keys = leaf ? t->leaf_max_keys : t->max_keys;
+
+    // fewest nodes that hold the run, with one entry moved up between each pair
+    size_t pieces = (run->n + max_keys + 1) / (max_keys + 1);
+    size_t kept = run->n - (pieces - 1);
+
+    BTNode *nodes = calloc(pieces, sizeof(BTNode));
+    BTNode **dirty = malloc(pieces * sizeof(BTNode *));
+    if (!nodes || !dirty) die("malloc");
+
+    // spread the entries evenly, the first piece keeps the original block
+    size_t pos = 0;
+    for (size_t p = 0; p < pieces; p++) {
+        BTNode *node = &nodes[p];
+        size_t n = kept / pieces + (p < kept % pieces);
+        node->block_id = p == 0 ? orig->block_id : alloc_node(t);
+        node->parent_id = orig->parent_id;
+        node->n = n;
+        memcpy(node->keys, &run->keys[pos], n * sizeof(uint64_t));
+        memcpy(node->values, &run->values[pos], n * sizeof(uint64_t));
+
+        uint64_t total = n;
+        if (!leaf) {
+            memcpy(node->children, &run->children[pos], (n + 1) * sizeof(uint64_t));
+            memcpy(node->counts, &run->counts[pos], (n + 1) * sizeof(uint64_t));
+            total = node_total(node);
+        }
+
+        if (p == 0) out->first_count = total;
+        else spill_push(out, run->keys[pos - 1], run->values[pos - 1], node->block_id, total);
+        dirty[p] = node;
+        pos += n + 1;
+    }
+    write_nodes(t, dirty, pieces);
+
+    // children that moved to a new node get their parent fixed
+    if (!leaf) {
+        for (size_t p = 1; p < pieces; p++) adopt_children(t, &nodes[p]);
+    }
+
+    free(dirty);
+    free(nodes);
+}
+
+// helper to merge sorted pairs into the subtree of a node
+static void merge_node(BTree *t, const BTNode *node, const BatchPair *pairs, size_t count,
+                       Spill *out) {
+    Run run = {0};
+
+    if (node->children[0] == 0) {
+        // merge the leaf entries with the pairs, new copies after old ones
+        size_t i = 0, j = 0;
+        while (i < (size_t)node->n || j < count) {
+            if (j == count || (i < (size_t)node->n && node->keys[i] <= pairs[j].key)) {
+                run_push_entry(&run, node->keys[i], node->values[i]);
+                i++;
+            } else {
+                run_push_entry(&run, pairs[j].key, pairs[j].value);
+                j++;
+            }
+        }
+        emit_nodes(t, node, &run, out);
+        run_free(&run);
+        return;
+    }
+
+    // find the part of the batch below each child (equal keys go right)
+    size_t bounds[MAX_CHILDREN + 1];
+    uint64_t ids[MAX_CHILDREN];
+    int touched[MAX_CHILDREN];
+    int ntouched = 0;
+    bounds[0] = 0;
+    for (int i = 0; i <= node->n; i++) {
+        size_t hi = bounds[i];
+        while (hi < count && (i == node->n || pairs[hi].key < node->keys[i])) hi++;
+        bounds[i + 1] = hi;
+        if (hi > bounds[i]) {
+            touched[ntouched] = i;
+            ids[ntouched] = node->children[i];
+            ntouched++;
+        }
+    }
+
+    // read every child that gets pairs in one batch
+    BTNode *kids = malloc(ntouched * sizeof(BTNode));
+    if (!kids) die("malloc");
+    read_nodes(t, ids, ntouched, kids);
+    for (int k = 0; k < ntouched; k++) kids[k].parent_id = node->block_id;
+
+    // rebuild the node from its children and whatever they were cut into
+    int next = 0;
+    for (int i = 0; i <= node->n; i++) {
+        if (next < ntouched && touched[next] == i) {
+            Spill spill = {0};
+            merge_node(t, &kids[next], &pairs[bounds[i]], bounds[i + 1] - bounds[i], &spill);
+            run_push_child(&run, node->children[i], spill.first_count);
+            for (size_t s = 0; s < spill.n; s++) {
+                run_push_entry(&run, spill.keys[s], spill.values[s]);
+                run_push_child(&run, spill.ids[s], spill.counts[s]);
+            }
+            spill_free(&spill);
+            next++;
+        } else {
+            run_push_child(&run, node->children[i], node->counts[i]);
+        }
+        if (i < node->n) run_push_entry(&run, node->keys[i], node->values[i]);
+    }
+    free(kids);
+
+    emit_nodes(t, node, &run, out);
+    run_free(&run);
+}
+
+void batch_merge(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count) {
+    if (count == 0) return;
+
+    // sort the batch, keeping duplicates in input order
+    BatchPair *pairs = malloc(count * sizeof(BatchPair));
+    if (!pairs) die("malloc");
+    for (size_t i = 0; i < count; i++) {
+        pairs[i].key = keys[i];
+        pairs[i].value = values[i];
+        pairs[i].seq = i;
+    }
+    qsort(pairs, count, sizeof(BatchPair), compare_pairs);
+
+    // the cached right edge may hold nodes that change, and the batch may
+    // hold a new largest key
+    append_forget(t);
+
+    BTNode root;
+    Spill spill = {0};
+    read_node(t, t->hdr.root_block, &root);
+    root.parent_id = 0;
+    merge_node(t, &root, pairs, count, &spill);
+    free(pairs);
+
+    // a root that was cut gets a new root above it, until one node is left
+    while (spill.n > 0) {
+        Run run = {0};
+        run_push_child(&run, t->hdr.root_block, spill.first_count);
+        for (size_t s = 0; s < spill.n; s++) {
+            run_push_entry(&run, spill.keys[s], spill.values[s]);
+            run_push_child(&run, spill.ids[s], spill.counts[s]);
+        }
+        spill_free(&spill);
+
+        BTNode new_root;
+        memset(&new_root, 0, sizeof(new_root));
+        new_root.block_id = alloc_node(t);
+        Spill up = {0};
+        emit_nodes(t, &new_root, &run, &up);
+        run_free(&run);
+
+        // the first piece keeps the old top level as its children
+        read_node(t, new_root.block_id, &new_root);
+        adopt_children(t, &new_root);
+        t->hdr.root_block = new_root.block_id;
+        spill = up;
+    }
+    spill_free(&spill);
+}
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bloom.h"
+#include "utils.h"
+
+/**
+ * Sidecar file layout (all fields big-endian)
+ *   0  magic "4348BLM1"
+ *   8  index generation the filter matches
+ *  16  nblocks, bits_per_key, num_hashes, capacity, nkeys
+ *  56  filtered, false_positives
+ * 128  nblocks * 8 words of filter bits
+ */
+#define BLOOM_MAGIC         "4348BLM1"
+#define BLOOM_HEADER_SIZE   128
+#define BLOOM_STATS_OFFSET  56
+
+// 64-bit words per block (one 64-byte cache line)
+#define BLOCK_WORDS         8
+
+// helper to mix the bits of a key (splitmix64 finalizer)
+static uint64_t mix64(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// helper to locate the block of a key
+static uint64_t *key_block(const Bloom *bf, uint64_t h) {
+    return bf->bits + (h % bf->nblocks) * BLOCK_WORDS;
+}
+
+Bloom* bloom_new(uint64_t capacity, uint64_t bits_per_key) {
+    Bloom *bf = calloc(1, sizeof(*bf));
+    if (!bf) die("calloc");
+
+    if (capacity < 1024) capacity = 1024;
+    if (bits_per_key < 1) bits_per_key = 1;
+
+    // round the bit count up to whole blocks
+    uint64_t bits = capacity * bits_per_key;
+    bf->nblocks = (bits + 511) / 512;
+    bf->bits_per_key = bits_per_key;
+    bf->capacity = capacity;
+
+    // k = bits_per_key * ln(2) minimizes the false positive rate
+    bf->num_hashes = (bits_per_key * 69 + 50) / 100;
+    if (bf->num_hashes < 1) bf->num_hashes = 1;
+    if (bf->num_hashes > 16) bf->num_hashes = 16;
+
+    bf->bits = calloc(bf->nblocks * BLOCK_WORDS, sizeof(uint64_t));
+    if (!bf->bits) die("calloc");
+    return bf;
+}
+
+void bloom_free(Bloom *bf) {
+    if (!bf) return;
+    free(bf->bits);
+    free(bf);
+}
+
+void bloom_add(Bloom *bf, uint64_t key) {
+    uint64_t h = mix64(key);
+    uint64_t *block = key_block(bf, h);
+
+    // double hashing inside the block
+    uint64_t g = mix64(h);
+    uint32_t a = (uint32_t)g;
+    uint32_t b = (uint32_t)(g >> 32) | 1;
+    for (uint64_t i = 0; i < bf->num_hashes; i++) {
+        uint32_t bit = (a + i * b) & 511;
+        block[bit >> 6] |= (uint64_t)1 << (bit & 63);
+    }
+    bf->nkeys++;
+}
+
+int bloom_may_contain(const Bloom *bf, uint64_t key) {
+    uint64_t h = mix64(key);
+    const uint64_t *block = key_block(bf, h);
+
+    uint64_t g = mix64(h);
+    uint32_t a = (uint32_t)g;
+    uint32_t b = (uint32_t)(g >> 32) | 1;
+    for (uint64_t i = 0; i < bf->num_hashes; i++) {
+        uint32_t bit = (a + i * b) & 511;
+        if (!(block[bit >> 6] & ((uint64_t)1 << (bit & 63)))) return 0;
+    }
+    return 1;
+}
+
+Bloom* bloom_load(const char *path, uint64_t generation) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    // read and check the header
+    uint64_t hdr[BLOOM_HEADER_SIZE / 8];
+    if (fread(hdr, 1, BLOOM_HEADER_SIZE, file) != BLOOM_HEADER_SIZE ||
+        memcmp(hdr, BLOOM_MAGIC, 8) != 0 ||
+        be64_to_host(hdr[1]) != generation) {
+        fclose(file);
+        return NULL;
+    }
+
+    Bloom *bf = calloc(1, sizeof(*bf));
+    if (!bf) die("calloc");
+    bf->nblocks = be64_to_host(hdr[2]);
+    bf->bits_per_key = be64_to_host(hdr[3]);
+    bf->num_hashes = be64_to_host(hdr[4]);
+    bf->capacity = be64_to_host(hdr[5]);
+    bf->nkeys = be64_to_host(hdr[6]);
+    bf->filtered = be64_to_host(hdr[7]);
+    bf->false_positives = be64_to_host(hdr[8]);
+
+    // read the filter bits
+    uint64_t words = bf->nblocks * BLOCK_WORDS;
+    bf->bits = malloc(words * sizeof(uint64_t));
+    if (bf->nblocks == 0 || !bf->bits ||
+        fread(bf->bits, sizeof(uint64_t), words, file) != words) {
+        fclose(file);
+        bloom_free(bf);
+        return NULL;
+    }
+    fclose(file);
+
+    for (uint64_t i = 0; i < words; i++) bf->bits[i] = be64_to_host(bf->bits[i]);
+    return bf;
+}
+
+int bloom_save(const Bloom *bf, const char *path, uint64_t generation) {
+    // write to a temporary file and rename it, so readers never see a torn filter
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) return -1;
+
+    // header
+    uint64_t hdr[BLOOM_HEADER_SIZE / 8];
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, BLOOM_MAGIC, 8);
+    hdr[1] = host_to_be64(generation);
+    hdr[2] = host_to_be64(bf->nblocks);
+    hdr[3] = host_to_be64(bf->bits_per_key);
+    hdr[4] = host_to_be64(bf->num_hashes);
+    hdr[5] = host_to_be64(bf->capacity);
+    hdr[6] = host_to_be64(bf->nkeys);
+    hdr[7] = host_to_be64(bf->filtered);
+    hdr[8] = host_to_be64(bf->false_positives);
+    int ok = fwrite(hdr, 1, BLOOM_HEADER_SIZE, file) == BLOOM_HEADER_SIZE;
+
+    // filter bits, converted a block at a time
+    for (uint64_t b = 0; ok && b < bf->nblocks; b++) {
+        uint64_t block[BLOCK_WORDS];
+        for (int i = 0; i < BLOCK_WORDS; i++) {
+            block[i] = host_to_be64(bf->bits[b * BLOCK_WORDS + i]);
+        }
+        ok = fwrite(block, sizeof(uint64_t), BLOCK_WORDS, file) == BLOCK_WORDS;
+    }
+
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) {
+        remove(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int bloom_save_stats(const Bloom *bf, const char *path) {
+    FILE *file = fopen(path, "r+b");
+    if (file == NULL) return -1;
+
+    // only touch a file that is still a filter
+    char magic[8];
+    uint64_t stats[2] = { host_to_be64(bf->filtered), host_to_be64(bf->false_positives) };
+    int ok = fread(magic, 1, 8, file) == 8 && memcmp(magic, BLOOM_MAGIC, 8) == 0 &&
+             fseek(file, BLOOM_STATS_OFFSET, SEEK_SET) == 0 &&
+             fwrite(stats, sizeof(uint64_t), 2, file) == 2;
+
+    if (fclose(file) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
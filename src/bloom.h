@@ -0,0 +1,79 @@
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdint.h>
+
+/**
+ * Blocked Bloom filter kept in a sidecar file next to an index
+ */
+
+/**
+ * Bloom filter. Every key sets all of its bits inside a single 64-byte
+ * block, so a lookup touches one cache line.
+ */
+typedef struct {
+    uint64_t  nblocks;          // number of 64-byte blocks
+    uint64_t  bits_per_key;     // bits reserved per expected key
+    uint64_t  num_hashes;       // bits set per key
+    uint64_t  capacity;         // number of keys the filter was sized for
+    uint64_t  nkeys;            // keys added so far
+    uint64_t  filtered;         // lookups answered by the filter alone
+    uint64_t  false_positives;  // lookups that passed the filter but missed
+    uint64_t *bits;             // nblocks * 8 words
+} Bloom;
+
+/**
+ * Create an empty filter
+ * @param capacity      Number of keys to size the filter for
+ * @param bits_per_key  Bits to reserve per key
+ * @return              New filter (dies on allocation failure)
+ */
+Bloom* bloom_new(uint64_t capacity, uint64_t bits_per_key);
+
+/**
+ * Free a filter
+ * @param bf    Filter to free (may be NULL)
+ */
+void bloom_free(Bloom *bf);
+
+/**
+ * Add a key to the filter
+ * @param bf    Filter
+ * @param key   Key to add
+ */
+void bloom_add(Bloom *bf, uint64_t key);
+
+/**
+ * Check whether a key may be in the filter
+ * @param bf    Filter
+ * @param key   Key to check
+ * @return      0 if the key is definitely absent, 1 if it may be present
+ */
+int bloom_may_contain(const Bloom *bf, uint64_t key);
+
+/**
+ * Load a filter from a sidecar file
+ * @param path          Path to the sidecar file
+ * @param generation    Index generation the filter must have been saved for
+ * @return              Filter, or NULL if the file is missing, invalid or stale
+ */
+Bloom* bloom_load(const char *path, uint64_t generation);
+
+/**
+ * Save a filter to a sidecar file
+ * @param bf            Filter
+ * @param path          Path to the sidecar file
+ * @param generation    Index generation the filter matches
+ * @return              0 on success, -1 on error
+ */
+int bloom_save(const Bloom *bf, const char *path, uint64_t generation);
+
+/**
+ * Rewrite only the lookup counters of a saved filter
+ * @param bf            Filter
+ * @param path          Path to the sidecar file
+ * @return              0 on success, -1 on error
+ */
+int bloom_save_stats(const Bloom *bf, const char *path);
+
+#endif /* BLOOM_H */
@@ -2,85 +2,393 @@
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #include "btree.h"
+#include "btree_internal.h"
 #include "io.h"
 #include "constants.h"
 #include "utils.h"
 
-struct BTree {
-    int      fd;
-    BTHeader hdr;
-};
+// buffered layout: block_id, parent_id, n, then max_keys + 1 children, then
+// either leaf_max_keys keys and values (leaf) or max_keys keys and values,
+// nmsgs, BUFFER_MESSAGES message keys and values and one type byte per
+// message (internal node, 483 bytes with BUFFERED_DEGREE)
+static void node_decode_buffered(const BTree *t, const uint8_t *buf, BTNode *node) {
+    size_t off = 24;
+    for (int i = 0; i <= t->max_keys; i++) node->children[i] = get64(buf, off + 8*i);
+    off += 8 * (t->max_keys + 1);
+
+    int leaf = node->children[0] == 0;
+    int max_keys = leaf ? t->leaf_max_keys : t->max_keys;
+    for (int i = 0; i < max_keys; i++) node->keys[i] = get64(buf, off + 8*i);
+    off += 8 * max_keys;
+    for (int i = 0; i < max_keys; i++) node->values[i] = get64(buf, off + 8*i);
+    off += 8 * max_keys;
+    if (leaf) return;
+
+    node->nmsgs = get64(buf, off);
+    if (node->nmsgs > BUFFER_MESSAGES) die("corrupt message buffer");
+    off += 8;
+    for (int i = 0; i < BUFFER_MESSAGES; i++) node->msg_keys[i] = get64(buf, off + 8*i);
+    off += 8 * BUFFER_MESSAGES;
+    for (int i = 0; i < BUFFER_MESSAGES; i++) node->msg_values[i] = get64(buf, off + 8*i);
+    off += 8 * BUFFER_MESSAGES;
+    memcpy(node->msg_types, buf + off, BUFFER_MESSAGES);
+}
 
-// Node of a B-tree
-typedef struct {
-    uint64_t block_id;               // block id this node is stored in (8 bytes)
-    uint64_t parent_id;              // block id of parent (0 if root) (8 bytes)
-    uint64_t n;                      // number of key/value pairs (8 bytes)
-    uint64_t keys[MAX_KEYS];         // keys array (19 * 8 bytes = 152 bytes)
-    uint64_t values[MAX_KEYS];       // values array (19 * 8 bytes = 152 bytes)
-    uint64_t children[MAX_CHILDREN]; // child pointers (20 * 8 bytes = 160 bytes)
-    uint8_t  pad[BLOCK_SIZE - (8 + 8 + 8 + MAX_KEYS*8 + MAX_KEYS*8 + MAX_CHILDREN*8)]; // padding
-} BTNode;
+static void node_encode_buffered(const BTree *t, const BTNode *node, uint8_t *buf) {
+    size_t off = 24;
+    for (int i = 0; i <= t->max_keys; i++) put64(buf, off + 8*i, node->children[i]);
+    off += 8 * (t->max_keys + 1);
+
+    int leaf = node->children[0] == 0;
+    int max_keys = leaf ? t->leaf_max_keys : t->max_keys;
+    for (int i = 0; i < max_keys; i++) put64(buf, off + 8*i, node->keys[i]);
+    off += 8 * max_keys;
+    for (int i = 0; i < max_keys; i++) put64(buf, off + 8*i, node->values[i]);
+    off += 8 * max_keys;
+    if (leaf) return;
+
+    put64(buf, off, node->nmsgs);
+    off += 8;
+    for (int i = 0; i < BUFFER_MESSAGES; i++) put64(buf, off + 8*i, node->msg_keys[i]);
+    off += 8 * BUFFER_MESSAGES;
+    for (int i = 0; i < BUFFER_MESSAGES; i++) put64(buf, off + 8*i, node->msg_values[i]);
+    off += 8 * BUFFER_MESSAGES;
+    memcpy(buf + off, node->msg_types, BUFFER_MESSAGES);
+}
 
-// helper to read node from file
-static void read_node(BTree *t, uint64_t id, BTNode *node) {
-    if (io_read_node(t->fd, id, node) < 0) die("io_read_node");
+// helper to convert a raw block read from disk to a node
+static void node_decode(const BTree *t, const uint8_t *buf, BTNode *node) {
+    int max_keys = t->max_keys;
+    memset(node, 0, sizeof(*node));
+
+    node->block_id = get64(buf, 0);
+    node->parent_id = get64(buf, 8);
+    node->n = get64(buf, 16);
+    // generations sit at the end of the block in every layout
+    node->gen = get64(buf, NODE_GEN_OFFSET);
+    node->max_gen = get64(buf, NODE_GEN_OFFSET + 8);
+    if (t->hdr.flags & BT_FLAG_BUFFERED) {
+        node_decode_buffered(t, buf, node);
+        return;
+    }
+    // keys, values and children follow each other, sized for this format
+    size_t off = 24;
+    for (int i = 0; i < max_keys; i++) node->keys[i] = get64(buf, off + 8*i);
+    off += 8 * max_keys;
+    for (int i = 0; i < max_keys; i++) node->values[i] = get64(buf, off + 8*i);
+    off += 8 * max_keys;
+    for (int i = 0; i <= max_keys; i++) node->children[i] = get64(buf, off + 8*i);
+    off += 8 * (max_keys + 1);
+    // subtree sizes
+    if (t->hdr.flags & BT_FLAG_COUNTED) {
+        for (int i = 0; i <= max_keys; i++) node->counts[i] = get64(buf, off + 8*i);
+    }
+}
 
-    // convert from big-endian to host endianness
-    node->block_id = be64_to_host(node->block_id);
-    node->parent_id = be64_to_host(node->parent_id);
-    node->n = be64_to_host(node->n);
-    // keys and values
-    for (int i = 0; i < MAX_KEYS; i++) {
-        node->keys[i] = be64_to_host(node->keys[i]);
-        node->values[i] = be64_to_host(node->values[i]);
+int block_children(const void *buf, uint64_t flags, int max_keys, uint64_t *children) {
+    uint64_t n = get64(buf, 16);
+    if (n > (uint64_t)max_keys) return 0;
+
+    // buffered nodes store their children first, the others after the values
+    size_t off = (flags & BT_FLAG_BUFFERED) ? 24 : 24 + 16 * (size_t)max_keys;
+    if (get64(buf, off) == 0) return 0;
+    for (uint64_t i = 0; i <= n; i++) children[i] = get64(buf, off + 8*i);
+    return n + 1;
+}
+
+// helper to build the raw on-disk block of a node
+static void node_encode(const BTree *t, const BTNode *node, uint8_t *buf) {
+    int max_keys = t->max_keys;
+    memset(buf, 0, BLOCK_SIZE);
+
+    put64(buf, 0, node->block_id);
+    put64(buf, 8, node->parent_id);
+    put64(buf, 16, node->n);
+    put64(buf, NODE_GEN_OFFSET, node->gen);
+    put64(buf, NODE_GEN_OFFSET + 8, node->max_gen);
+    if (t->hdr.flags & BT_FLAG_BUFFERED) {
+        node_encode_buffered(t, node, buf);
+        return;
     }
-    // children
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        node->children[i] = be64_to_host(node->children[i]);
+    size_t off = 24;
+    for (int i = 0; i < max_keys; i++) put64(buf, off + 8*i, node->keys[i]);
+    off += 8 * max_keys;
+    for (int i = 0; i < max_keys; i++) put64(buf, off + 8*i, node->values[i]);
+    off += 8 * max_keys;
+    for (int i = 0; i <= max_keys; i++) put64(buf, off + 8*i, node->children[i]);
+    off += 8 * (max_keys + 1);
+    if (t->hdr.flags & BT_FLAG_COUNTED) {
+        for (int i = 0; i <= max_keys; i++) put64(buf, off + 8*i, node->counts[i]);
     }
 }
 
+// helper to pick the node layout recorded in the header
+static void set_format(BTree *t) {
+    // subtree sizes take room from the keys, so counted nodes use a smaller degree
+    t->degree = (t->hdr.flags & BT_FLAG_COUNTED) ? COUNTED_DEGREE : DEGREE;
+    t->leaf_degree = t->degree;
+    // buffered internal nodes give most of their block to the message buffer
+    if (t->hdr.flags & BT_FLAG_BUFFERED) t->degree = BUFFERED_DEGREE;
+    t->max_keys = 2 * t->degree - 1;
+    t->leaf_max_keys = 2 * t->leaf_degree - 1;
+}
+
+void read_block(BTree *t, uint64_t id, void *buf) {
+    if (t->hot) hot_note(t, id);
+
+    // direct I/O handles look in their own cache first
+    if (t->cache && cache_get(t->cache, id, buf)) return;
+    if (io_read_node(t->fd, id, buf) < 0) die("io_read_node");
+    if (t->cache) cache_put(t->cache, id, buf);
+}
+
+void write_block(BTree *t, uint64_t id, const void *buf) {
+    if (io_write_node(t->fd, id, buf) < 0) die("io_write_node");
+    if (t->cache) cache_put(t->cache, id, buf);
+}
+
+// helper to find the generation that writes of this handle belong to: the
+// one begin_write opened, or the copy-on-write commit being built
+static uint64_t write_generation(const BTree *t) {
+    return (t->hdr.flags & BT_FLAG_COW) ? t->hdr.generation + 1 : t->hdr.generation;
+}
+
+// helper to read node from file
+void read_node(BTree *t, uint64_t id, BTNode *node) {
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    read_block(t, id, buf);
+    // convert from big-endian to host endianness
+    node_decode(t, buf, node);
+}
+
 // helper to write node to file
-static void write_node(BTree *t, uint64_t id, BTNode *node) {
-    // create a copy of the node to be modified for storage
-    BTNode node_be = *node;
-    
-    // convert from host to big-endian
-    node_be.block_id = host_to_be64(node->block_id);
-    node_be.parent_id = host_to_be64(node->parent_id);
-    node_be.n = host_to_be64(node->n);
-    // keys and values
-    for (int i = 0; i < MAX_KEYS; i++) {
-        node_be.keys[i] = host_to_be64(node->keys[i]);
-        node_be.values[i] = host_to_be64(node->values[i]);
-    }
-    // children
-    for (int i = 0; i < MAX_CHILDREN; i++) {
-        node_be.children[i] = host_to_be64(node->children[i]);
-    }
+void write_node(BTree *t, uint64_t id, BTNode *node) {
+    // build the big-endian copy of the node for storage
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    // the node and its subtree changed in this generation
+    node->gen = node->max_gen = write_generation(t);
+    node_encode(t, node, buf);
     // write to file
-    if (io_write_node(t->fd, id, &node_be) < 0) die("io_write_node");
+    write_block(t, id, buf);
+}
+
+void touch_node(BTree *t, BTNode *node) {
+    uint64_t gen = write_generation(t);
+    if (node->max_gen >= gen) return;
+
+    // only the subtree changed, the node's own entries keep their generation
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    node->max_gen = gen;
+    node_encode(t, node, buf);
+    write_block(t, node->block_id, buf);
+}
+
+// helper to write several nodes with a single batched submission
+void write_nodes(BTree *t, BTNode **nodes, int count) {
+    uint8_t *bufs = io_alloc((size_t)count * BLOCK_SIZE);
+    IoRequest *reqs = malloc(count * sizeof(IoRequest));
+    if (!bufs || !reqs) die("malloc");
+
+    // convert every node and queue its write
+    uint64_t gen = write_generation(t);
+    for (int i = 0; i < count; i++) {
+        nodes[i]->gen = nodes[i]->max_gen = gen;
+        node_encode(t, nodes[i], bufs + (size_t)i * BLOCK_SIZE);
+        reqs[i].block_id = nodes[i]->block_id;
+        reqs[i].buf = bufs + (size_t)i * BLOCK_SIZE;
+        reqs[i].write = 1;
+    }
+    if (io_batch_submit(t->fd, reqs, count) < 0) die("io_batch_submit");
+    if (io_batch_wait_all(reqs, count) < 0) die("io_write_node");
+    if (t->cache) {
+        for (int i = 0; i < count; i++) cache_put(t->cache, reqs[i].block_id, reqs[i].buf);
+    }
+
+    free(reqs);
+    io_free(bufs, (size_t)count * BLOCK_SIZE);
+}
+
+// helper to start reading several nodes in one batch into raw buffers;
+// each node must be finished with wait_node before it is used
+static void prefetch_nodes(BTree *t, const uint64_t *ids, int count,
+                           uint8_t (*bufs)[BLOCK_SIZE], IoRequest *reqs) {
+    for (int i = 0; i < count; i++) {
+        reqs[i].block_id = ids[i];
+        reqs[i].buf = bufs[i];
+        reqs[i].write = 0;
+        if (t->hot) hot_note(t, ids[i]);
+    }
+    if (!t->cache) {
+        if (io_batch_submit(t->fd, reqs, count) < 0) die("io_batch_submit");
+        return;
+    }
+
+    // cached blocks are complete right away, runs of misses are submitted together
+    int i = 0;
+    while (i < count) {
+        if (cache_get(t->cache, ids[i], bufs[i])) {
+            reqs[i].done = 1;
+            reqs[i].result = 0;
+            i++;
+            continue;
+        }
+        int start = i++;
+        while (i < count && !cache_get(t->cache, ids[i], bufs[i])) i++;
+        if (io_batch_submit(t->fd, &reqs[start], i - start) < 0) die("io_batch_submit");
+        if (i < count) {
+            // the block that ended the run was a hit
+            reqs[i].done = 1;
+            reqs[i].result = 0;
+            i++;
+        }
+    }
+}
+
+// helper to wait for a prefetched node and decode it
+static void wait_node(BTree *t, IoRequest *req, BTNode *node) {
+    if (io_batch_wait(req) < 0) die("io_read_node");
+    if (t->cache) cache_put(t->cache, req->block_id, req->buf);
+    node_decode(t, req->buf, node);
+}
+
+void read_nodes(BTree *t, const uint64_t *ids, int count, BTNode *nodes) {
+    uint8_t (*bufs)[BLOCK_SIZE] = io_alloc((size_t)count * BLOCK_SIZE);
+    IoRequest *reqs = malloc(count * sizeof(IoRequest));
+    if (!bufs || !reqs) die("malloc");
+
+    prefetch_nodes(t, ids, count, bufs, reqs);
+    for (int i = 0; i < count; i++) wait_node(t, &reqs[i], &nodes[i]);
+
+    free(reqs);
+    io_free(bufs, (size_t)count * BLOCK_SIZE);
+}
+
+void adopt_children(BTree *t, const BTNode *node) {
+    if (node->children[0] == 0) return;
+
+    // read all children in one batch, then write them back in another
+    int count = node->n + 1;
+    BTNode *kids = malloc(count * sizeof(BTNode));
+    uint8_t (*bufs)[BLOCK_SIZE] = io_alloc(count * BLOCK_SIZE);
+    IoRequest reqs[MAX_CHILDREN];
+    BTNode *dirty[MAX_CHILDREN];
+    if (!kids || !bufs) die("malloc");
+    prefetch_nodes(t, node->children, count, bufs, reqs);
+    for (int i = 0; i < count; i++) {
+        wait_node(t, &reqs[i], &kids[i]);
+        kids[i].parent_id = node->block_id;
+        dirty[i] = &kids[i];
+    }
+    write_nodes(t, dirty, count);
+
+    io_free(bufs, count * BLOCK_SIZE);
+    free(kids);
+}
+
+int node_full(const BTree *t, const BTNode *node) {
+    int max_keys = node->children[0] == 0 ? t->leaf_max_keys : t->max_keys;
+    return node->n == max_keys;
+}
+
+// helper to count the entries of a subtree from its root node
+uint64_t node_total(const BTNode *node) {
+    uint64_t total = node->n;
+    if (node->children[0] != 0) {
+        for (int i = 0; i <= node->n; i++) total += node->counts[i];
+    }
+    return total;
 }
 
 // helper to allocate a fresh block
-static uint64_t alloc_node(BTree *t) {
+uint64_t alloc_node(BTree *t) {
+    // copy-on-write files reuse blocks that no snapshot can see anymore
+    if (t->hdr.flags & BT_FLAG_COW) {
+        uint64_t id = cow_alloc(t);
+        if (id != 0) return id;
+    }
+
     // update the header to point to the next free block
     uint64_t id = t->hdr.next_free_block++;
     // return the block id
     return id;
 }
 
+// helper to visit the copies of a key in a subtree, in order
+static void scan_key_node(BTree *t, uint64_t node_id, uint64_t key, ScanFn fn, void *ctx) {
+    BTNode node;
+    read_node(t, node_id, &node);
+    int leaf = node.children[0] == 0;
+
+    for (int i = 0; i <= node.n; i++) {
+        // copies may sit on both sides of an equal separator
+        if (!leaf && (i == 0 || node.keys[i-1] <= key) && (i == node.n || node.keys[i] >= key)) {
+            scan_key_node(t, node.children[i], key, fn, ctx);
+        }
+        if (i < node.n && node.keys[i] == key) fn(ctx, key, node.values[i]);
+        if (i < node.n && node.keys[i] > key) break;
+    }
+}
+
+void tree_scan_key(BTree *t, uint64_t key, ScanFn fn, void *ctx) {
+    scan_key_node(t, t->hdr.root_block, key, fn, ctx);
+}
+
+// helper to insert a key-value pair into a leaf with room for it
+void leaf_insert(BTNode *node, uint64_t key, uint64_t value) {
+    // shift keys and values to make room for new entry
+    int i = node->n - 1;
+    while (i >= 0 && key < node->keys[i]) {
+        node->keys[i+1] = node->keys[i];
+        node->values[i+1] = node->values[i];
+        i--;
+    }
+
+    // insert the new key and value
+    node->keys[i+1] = key;
+    node->values[i+1] = value;
+    node->n++;
+}
+
+void begin_write(BTree *t) {
+    lock_write(t);
+    t->modified = 1;
+    t->unpublished = 1;
+    if (t->dirty) return;
+    t->dirty = 1;
+
+    // bump the generation on disk right away, so sidecar files saved for the
+    // old generation are not trusted if this handle never gets to close
+    t->hdr.generation++;
+    if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+}
+
+// helper to build the path of a sidecar file next to the index
+static void sidecar_path(BTree *t, const char *ext, char *buf, size_t size) {
+    snprintf(buf, size, "%s.%s", t->path, ext);
+}
+
+// helper to switch a handle to direct I/O through its own block cache,
+// returns -1 if the file system does not support it
+static int open_direct(BTree *t) {
+    if (io_set_direct(t->fd) < 0) return -1;
+    t->cache = cache_new(t->hdr.cache_blocks);
+    return 0;
+}
+
+
 // forward declarations
 static void split_child(BTree *t, uint64_t parent_id, int idx);
 static void insert_nonfull(BTree *t, uint64_t node_id, uint64_t key, uint64_t value);
 static void print_node(BTree *t, uint64_t node_id, int level);
-static int extract_node(BTree *t, FILE *file, uint64_t node_id, int *pair_count);
+static void scan_node(BTree *t, const BTNode *node, uint64_t min_gen, ScanFn fn, void *ctx);
+static void scan_tree(BTree *t, uint64_t min_gen, ScanFn fn, void *ctx);
+static int search_tree(BTree *t, uint64_t key, uint64_t *value);
 
 
-BTree* bt_create(const char *filename) {
+BTree* bt_create(const char *filename, uint64_t flags) {
     // check if file exists
     if (io_file_exists(filename)) die("file already exists");
 
@@ -91,21 +399,87 @@ BTree* bt_create(const char *filename) {
     // open the file for reading and writing
     t->fd = io_open(filename, O_RDWR|O_CREAT);
     if (t->fd < 0) die("io_open");
+    t->path = strdup(filename);
+    if (!t->path) die("strdup");
 
     // initialize header
     memcpy(&t->hdr.magic, MAGIC_NUMBER, 8);
     t->hdr.root_block = 1;
     t->hdr.next_free_block = 2;
-    // write the header
+    t->hdr.flags = flags;
+    if (flags & BT_FLAG_BLOOM) t->hdr.bloom_bits = BLOOM_DEFAULT_BITS;
+    if (flags & BT_FLAG_DIRECT) t->hdr.cache_blocks = CACHE_DEFAULT_BLOCKS;
+    set_format(t);
+    if ((flags & BT_FLAG_DIRECT) && open_direct(t) < 0) {
+        // the file was only just created, so nothing is lost by removing it
+        unlink(filename);
+        die("direct I/O is not supported for this file");
+    }
+
+    if (flags & BT_FLAG_HASH) {
+        // hash indexes start with a directory and one bucket instead of a root
+        t->hdr.next_free_block = 1;
+        hash_create(t);
+        if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+    } else {
+        // write the header
+        if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+
+        // create empty root node
+        BTNode root = {0};
+        root.block_id = 1;
+        root.parent_id = 0; // root has no parent
+        root.n = 0;
+        // write the root node
+        write_node(t, 1, &root);
+    }
+
+    // start with an empty filter
+    if (flags & BT_FLAG_BLOOM) {
+        char bloom_path[4096];
+        sidecar_path(t, "bloom", bloom_path, sizeof(bloom_path));
+        t->bloom = bloom_new(0, t->hdr.bloom_bits);
+        if (bloom_save(t->bloom, bloom_path, t->hdr.generation) < 0) die("bloom_save");
+    }
+
+    // start with an empty secondary value index
+    if (flags & BT_FLAG_VALUES) vindex_create(t);
+
+    // other processes may open the file from now on
+    lock_open(t);
+    hot_open(t);
+
+    // return the BTree structure
+    return t;
+}
+
+BTree* bt_create_sharded(const char *filename, uint64_t flags, uint64_t shard_count) {
+    if (shard_count == 0) return bt_create(filename, flags);
+
+    // check if file exists
+    if (io_file_exists(filename)) die("file already exists");
+
+    // allocate memory for the BTree structure
+    BTree *t = calloc(1, sizeof(*t));
+    if (!t) die("calloc");
+
+    // open the file for reading and writing
+    t->fd = io_open(filename, O_RDWR|O_CREAT);
+    if (t->fd < 0) die("io_open");
+    t->path = strdup(filename);
+    if (!t->path) die("strdup");
+
+    // the manifest is only a header naming the shards
+    memcpy(&t->hdr.magic, MAGIC_NUMBER, 8);
+    t->hdr.next_free_block = 1;
+    t->hdr.flags = flags | BT_FLAG_SHARDED;
+    t->hdr.shard_count = shard_count;
+    if (flags & BT_FLAG_BLOOM) t->hdr.bloom_bits = BLOOM_DEFAULT_BITS;
+    if (flags & BT_FLAG_DIRECT) t->hdr.cache_blocks = CACHE_DEFAULT_BLOCKS;
     if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
 
-    // create empty root node
-    BTNode root = {0};
-    root.block_id = 1;
-    root.parent_id = 0; // root has no parent
-    root.n = 0;
-    // write the root node
-    write_node(t, 1, &root);
+    // create the shard files
+    shard_create(t);
 
     // return the BTree structure
     return t;
@@ -122,6 +496,8 @@ BTree* bt_open(const char *filename) {
     // open the file for reading and writing
     t->fd = io_open(filename, O_RDWR);
     if (t->fd < 0) die("io_open");
+    t->path = strdup(filename);
+    if (!t->path) die("strdup");
 
     // read the header
     if (io_read_header(t->fd, &t->hdr) < 0) die("io_read_header");
@@ -130,28 +506,194 @@ BTree* bt_open(const char *filename) {
     char magic_check[9] = {0};
     memcpy(magic_check, &t->hdr.magic, 8);
     if (strcmp(magic_check, MAGIC_NUMBER) != 0) die("invalid B-tree file");
+    if (t->hdr.flags & BT_FLAG_TYPED) die("index was created with the C++ template");
+    set_format(t);
+
+    // snapshots are read-only, only their model is needed
+    if (t->hdr.flags & BT_FLAG_FROZEN) {
+        frozen_open(t);
+        return t;
+    }
+
+    // a manifest holds no tree, every operation goes to its shards
+    if (t->hdr.flags & BT_FLAG_SHARDED) {
+        shard_open(t);
+        return t;
+    }
+
+    // direct I/O bypasses the page cache, so the handle keeps its own
+    if ((t->hdr.flags & BT_FLAG_DIRECT) && open_direct(t) < 0) die("direct I/O is not supported for this file");
+
+    // copy-on-write readers work on a pinned snapshot of the tree
+    if (t->hdr.flags & BT_FLAG_COW) cow_pin_snapshot(t);
+
+    // follow the changes of writers in other processes
+    lock_open(t);
+
+    // read what earlier sessions used most while the handle already serves
+    hot_open(t);
+    warm_start(t);
+
+    // the filter is only trusted if it was saved for this exact generation
+    if (t->hdr.flags & BT_FLAG_BLOOM) {
+        char bloom_path[4096];
+        sidecar_path(t, "bloom", bloom_path, sizeof(bloom_path));
+        t->bloom = bloom_load(bloom_path, t->hdr.generation);
+    }
+
+    // the secondary value index lives in its own file
+    if (t->hdr.flags & BT_FLAG_VALUES) vindex_open(t);
 
     // return the BTree structure
     return t;
 }
 
 void bt_close(BTree *t) {
-    // persist header
-    if (io_write_header(t->fd, &t->hdr) < 0) perror("io_write_header");
+    warm_stop(t);
+    if (t->shards) {
+        // the manifest header is written as soon as it changes
+        shard_close(t);
+    } else {
+        // save the filter before the header, which names its generation
+        if (t->hdr.flags & BT_FLAG_BLOOM) {
+            char bloom_path[4096];
+            sidecar_path(t, "bloom", bloom_path, sizeof(bloom_path));
+            if (t->modified) {
+                // stale or overfull filters are rebuilt from the tree
+                if (!t->bloom || t->bloom->nkeys > t->bloom->capacity) bloom_rebuild(t);
+                if (bloom_save(t->bloom, bloom_path, t->hdr.generation) < 0) perror("bloom_save");
+            } else if (t->bloom && t->bloom_stats_dirty) {
+                bloom_save_stats(t->bloom, bloom_path);
+            }
+        }
+
+        if (t->hdr.flags & BT_FLAG_COW) {
+            // commits already published the header, only the free list is left
+            cow_close(t);
+        } else if (t->unpublished) {
+            // only the writer gets here, readers leave the header alone
+            if (lock_publish(t) < 0) perror("io_write_header");
+        }
+    }
+
+    // record the blocks this session read most for the next one
+    hot_close(t);
 
-    // close file
+    // close file (which releases its locks)
+    lock_close(t);
     io_close(t->fd);
     // free memory
+    bloom_free(t->bloom);
+    cache_free(t->cache);
+    frozen_close(t);
+    vindex_close(t);
+    free(t->right_path);
+    free(t->path);
     free(t);
 }
 
 int bt_insert(BTree *t, uint64_t key, uint64_t value) {
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+
+    // every key lives in exactly one shard
+    if (t->shards) return bt_insert(shard_route(t, key), key, value);
+
+    // hash indexes keep one copy per key, so inserts and upserts are the same
+    if (t->hdr.flags & BT_FLAG_HASH) return bt_upsert(t, key, value);
+
+    lock_enter(t, 1);
+
+    // the secondary is written first, so it never misses a pair of the primary
+    if (t->vindex) vindex_add(t, key, value);
+
+    // copy-on-write files never modify a published block
+    if (t->hdr.flags & BT_FLAG_COW) {
+        t->modified = 1;
+        cow_insert(t, key, value, 0);
+        if (t->bloom) bloom_add(t->bloom, key);
+        lock_leave(t);
+        return SUCCESS;
+    }
+    begin_write(t);
+
+    // buffered trees only touch the root buffer
+    if (t->hdr.flags & BT_FLAG_BUFFERED) {
+        buffer_put(t, MSG_INSERT, key, value);
+    } else if (!append_insert(t, key, value)) {
+        // increasing keys are appended along the cached right edge, anything
+        // else descends from the root
+        tree_insert(t, key, value);
+    }
+
+    // keep the negative lookup filter in sync
+    if (t->bloom) bloom_add(t->bloom, key);
+    lock_leave(t);
+    return SUCCESS;
+}
+
+int bt_insert_batch(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count) {
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+
+    // each shard merges its own part of the batch
+    if (t->shards) return shard_insert_batch(t, keys, values, count);
+
+    // copy-on-write, buffered and hash indexes take the pairs one at a time
+    if (t->hdr.flags & (BT_FLAG_COW | BT_FLAG_BUFFERED | BT_FLAG_HASH)) {
+        for (size_t i = 0; i < count; i++) bt_insert(t, keys[i], values[i]);
+        return SUCCESS;
+    }
+    lock_enter(t, 1);
+    if (t->vindex) vindex_add_batch(t, keys, values, count);
+    begin_write(t);
+
+    // one walk of the tree for the whole batch
+    batch_merge(t, keys, values, count);
+
+    if (t->bloom) {
+        for (size_t i = 0; i < count; i++) bloom_add(t->bloom, keys[i]);
+    }
+    lock_leave(t);
+    return SUCCESS;
+}
+
+int bt_upsert(BTree *t, uint64_t key, uint64_t value) {
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+    if (t->shards) return bt_upsert(shard_route(t, key), key, value);
+    lock_enter(t, 1);
+
+    // the replaced value stays in the secondary, lookups check the primary
+    if (t->vindex) vindex_add(t, key, value);
+
+    if (t->hdr.flags & BT_FLAG_COW) {
+        t->modified = 1;
+        cow_insert(t, key, value, search_tree(t, key, NULL) == SUCCESS);
+    } else {
+        begin_write(t);
+        if (t->hdr.flags & BT_FLAG_HASH) {
+            hash_put(t, key, value);
+        } else if (t->hdr.flags & BT_FLAG_BUFFERED) {
+            // resolved when the message reaches the entry
+            buffer_put(t, MSG_UPSERT, key, value);
+        } else {
+            // the cached right edge may hold the node that changes, and a
+            // new key may be the largest
+            append_forget(t);
+            if (tree_update(t, key, value) != SUCCESS) tree_insert(t, key, value);
+        }
+    }
+
+    if (t->bloom) bloom_add(t->bloom, key);
+    lock_leave(t);
+    return SUCCESS;
+}
+
+void tree_insert(BTree *t, uint64_t key, uint64_t value) {
     // read root
     BTNode root;
     read_node(t, t->hdr.root_block, &root);
 
     // if root is full, split
-    if (root.n == MAX_KEYS) {
+    if (node_full(t, &root)) {
         // allocate new root
         uint64_t old_root_id = t->hdr.root_block;
         uint64_t new_root_id = alloc_node(t);
@@ -162,6 +704,7 @@ int bt_insert(BTree *t, uint64_t key, uint64_t value) {
         new_root.parent_id = 0; // new root has no parent
         new_root.n = 0; // no keys or values
         new_root.children[0] = old_root_id; // set first child to old root
+        new_root.counts[0] = node_total(&root); // everything is below the old root
 
         // update old root's parent_id
         root.parent_id = new_root_id;
@@ -180,10 +723,36 @@ int bt_insert(BTree *t, uint64_t key, uint64_t value) {
         // insert nonfull
         insert_nonfull(t, t->hdr.root_block, key, value);
     }
-    return 0;
 }
 
-int bt_search(BTree *t, uint64_t key, uint64_t *value) {
+int tree_update(BTree *t, uint64_t key, uint64_t value) {
+    // same descent as search_tree
+    BTNode node;
+    uint64_t current_node_id = t->hdr.root_block;
+
+    while (1) {
+        read_node(t, current_node_id, &node);
+
+        int i = 0;
+        while (i < node.n && key > node.keys[i]) i++;
+
+        // replace the value where search would find it
+        if (i < node.n && key == node.keys[i]) {
+            node.values[i] = value;
+            write_node(t, current_node_id, &node);
+            return SUCCESS;
+        }
+        if (node.children[0] == 0) return ERROR_KEY_NOT_FOUND;
+
+        // a miss is followed by an insert along the same path, so the
+        // subtree changes either way
+        touch_node(t, &node);
+        current_node_id = node.children[i];
+    }
+}
+
+// helper to look a key up by descending from the root
+static int search_tree(BTree *t, uint64_t key, uint64_t *value) {
     // start from the root node
     BTNode node;
     uint64_t current_node_id = t->hdr.root_block;
@@ -217,7 +786,77 @@ int bt_search(BTree *t, uint64_t key, uint64_t *value) {
     }
 }
 
-int bt_load(BTree *t, const char *csv_file) {
+int bt_search(BTree *t, uint64_t key, uint64_t *value) {
+    if (t->shards) return bt_search(shard_route(t, key), key, value);
+
+    // the filter is refreshed along with the header
+    lock_enter(t, 0);
+
+    // keys the filter has never seen are answered without any I/O
+    if (t->bloom && !bloom_may_contain(t->bloom, key)) {
+        t->bloom->filtered++;
+        t->bloom_stats_dirty = 1;
+        lock_leave(t);
+        return ERROR_KEY_NOT_FOUND;
+    }
+
+    int result;
+    if (t->hdr.flags & BT_FLAG_FROZEN) result = frozen_search(t, key, value);
+    else if (t->hdr.flags & BT_FLAG_HASH) result = hash_search(t, key, value);
+    else if (t->hdr.flags & BT_FLAG_BUFFERED) result = buffer_search(t, key, value);
+    else result = search_tree(t, key, value);
+
+    // count lookups the filter let through for nothing
+    if (t->bloom && result == ERROR_KEY_NOT_FOUND) {
+        t->bloom->false_positives++;
+        t->bloom_stats_dirty = 1;
+    }
+    lock_leave(t);
+    return result;
+}
+
+int compare_keys(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+void key_list_add(KeyList *list, uint64_t key) {
+    if (list->count == list->cap) {
+        list->cap = list->cap ? list->cap * 2 : 1024;
+        list->keys = realloc(list->keys, list->cap * sizeof(uint64_t));
+        if (!list->keys) die("realloc");
+    }
+    list->keys[list->count++] = key;
+}
+
+int bt_search_value(BTree *t, uint64_t value, uint64_t **keys, size_t *count) {
+    if (!(t->hdr.flags & BT_FLAG_VALUES)) return ERROR_UNSUPPORTED;
+    if (!t->shards) return vindex_search(t, value, keys, count);
+
+    // a key lives in one shard, so the shards' answers never overlap
+    uint64_t *all = NULL;
+    size_t total = 0;
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        uint64_t *found;
+        size_t n;
+        if (bt_search_value(t->shards[i], value, &found, &n) == ERROR_UNSUPPORTED) {
+            free(all);
+            return ERROR_UNSUPPORTED;
+        }
+        all = realloc(all, (total + n + 1) * sizeof(uint64_t));
+        if (!all) die("realloc");
+        memcpy(all + total, found, n * sizeof(uint64_t));
+        total += n;
+        free(found);
+    }
+    qsort(all, total, sizeof(uint64_t), compare_keys);
+
+    *keys = all;
+    *count = total;
+    return total > 0 ? SUCCESS : ERROR_KEY_NOT_FOUND;
+}
+
+int csv_for_each(const char *csv_file, PairFn fn, void *ctx) {
     // open the csv file for reading
     FILE *file = fopen(csv_file, "r");
     if (file == NULL) {
@@ -259,8 +898,8 @@ int bt_load(BTree *t, const char *csv_file) {
         // convert the value string to a 64-bit unsigned integer
         uint64_t value = strtoull(token, NULL, 10);
         
-        // insert the key-value pair into the b-tree
-        int result = bt_insert(t, key, value);
+        // hand the key-value pair to the caller
+        int result = fn(ctx, key, value);
         if (result != SUCCESS) {
             fprintf(stderr, "Error inserting key-value pair (%llu, %llu) at line %d\n", 
                     (unsigned long long)key, (unsigned long long)value, line_count);
@@ -271,13 +910,69 @@ int bt_load(BTree *t, const char *csv_file) {
 
     // close the file when done
     fclose(file);
+    return success_count;
+}
+
+// pairs read from the csv file but not merged yet
+typedef struct {
+    BTree    *t;
+    uint64_t *keys;
+    uint64_t *values;
+    size_t    count;
+} LoadBatch;
+
+// helper to queue one pair, merging the batch when it is full (csv callback)
+static int load_pair(void *ctx, uint64_t key, uint64_t value) {
+    LoadBatch *batch = ctx;
+    batch->keys[batch->count] = key;
+    batch->values[batch->count] = value;
+    if (++batch->count == LOAD_BATCH_PAIRS) {
+        bt_insert_batch(batch->t, batch->keys, batch->values, batch->count);
+        batch->count = 0;
+    }
+    return SUCCESS;
+}
+
+int bt_load(BTree *t, const char *csv_file) {
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+
+    // shards are built in parallel
+    if (t->shards) return shard_load(t, csv_file);
+
+    LoadBatch batch = { t, malloc(LOAD_BATCH_PAIRS * sizeof(uint64_t)),
+                        malloc(LOAD_BATCH_PAIRS * sizeof(uint64_t)), 0 };
+    if (!batch.keys || !batch.values) die("malloc");
+
+    // merge the csv file into the tree one sorted batch at a time
+    int success_count = csv_for_each(csv_file, load_pair, &batch);
+    if (success_count > 0) bt_insert_batch(t, batch.keys, batch.values, batch.count);
+    free(batch.keys);
+    free(batch.values);
+    if (success_count < 0) return -1;
+
+    // resize the filter for the loaded data
+    if ((t->hdr.flags & BT_FLAG_BLOOM) && success_count > 0) bloom_rebuild(t);
     
     // print summary and return success
     printf("Loaded %d key-value pairs from CSV file\n", success_count);
     return SUCCESS;
 }
 
-int bt_extract(BTree *t, const char *csv_file) {
+// state of an extract in progress
+typedef struct {
+    FILE *file;
+    int   pair_count;
+} ExtractCtx;
+
+// helper to write one pair to the csv file (scan callback)
+static void extract_pair(void *ctx, uint64_t key, uint64_t value) {
+    ExtractCtx *ex = ctx;
+    fprintf(ex->file, "%llu,%llu\n", (unsigned long long)key, (unsigned long long)value);
+    ex->pair_count++;
+}
+
+// helper to export the pairs of nodes written at min_gen or later
+static int extract(BTree *t, const char *csv_file, uint64_t min_gen) {
     // open the csv file for writing
     FILE *file = fopen(csv_file, "w");
     if (file == NULL) {
@@ -285,105 +980,403 @@ int bt_extract(BTree *t, const char *csv_file) {
         return -1;
     }
 
-    // write a header comment
+    // the whole export sees one version of the tree
+    lock_enter(t, 0);
+
+    // write a header comment, naming the generation the next export can
+    // continue from
+    uint64_t watermark = lock_watermark(t);
     fprintf(file, "# Key-value pairs extracted from B-tree\n");
     fprintf(file, "# Format: key,value\n");
+    if (min_gen > 0) {
+        fprintf(file, "# Changed after generation %llu (complete up to generation %llu)\n",
+                (unsigned long long)(min_gen - 1), (unsigned long long)watermark);
+    }
     
-    // counter for the number of key-value pairs extracted
-    int pair_count = 0;
-
-    // start traversal from the root node
-    int result = extract_node(t, file, t->hdr.root_block, &pair_count);
+    // traverse the tree in order, counting the pairs written
+    ExtractCtx ctx = { file, 0 };
+    if (t->shards || ((t->hdr.flags & BT_FLAG_HASH) && t->hdr.generation >= min_gen)) {
+        // merge the shards back into key order (hash buckets are sorted)
+        BTCursor *cursor = bt_cursor_open(t);
+        uint64_t key, value;
+        while (bt_cursor_next(cursor, &key, &value) == SUCCESS) extract_pair(&ctx, key, value);
+        bt_cursor_close(cursor);
+    } else {
+        scan_tree(t, min_gen, extract_pair, &ctx);
+    }
+    lock_leave(t);
 
     // close the file
     fclose(file);
 
     // print summary and return success
-    printf("Extracted %d key-value pairs to CSV file\n", pair_count);
+    if (min_gen > 0) {
+        printf("Extracted %d key-value pairs changed after generation %llu (complete up to generation %llu)\n",
+               ctx.pair_count, (unsigned long long)(min_gen - 1), (unsigned long long)watermark);
+    } else {
+        printf("Extracted %d key-value pairs to CSV file\n", ctx.pair_count);
+    }
+    return SUCCESS;
+}
+
+int bt_extract(BTree *t, const char *csv_file) {
+    return extract(t, csv_file, 0);
+}
+
+int bt_extract_since(BTree *t, const char *csv_file, uint64_t since) {
+    // every shard counts its own generations
+    if (t->shards) return ERROR_UNSUPPORTED;
+    return extract(t, csv_file, since + 1);
+}
+
+int bt_enable_bloom(BTree *t, uint64_t bits_per_key) {
+    if (bits_per_key == 0) return -1;
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+
+    // every shard keeps its own filter
+    if (t->shards) {
+        for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+            int result = bt_enable_bloom(t->shards[i], bits_per_key);
+            if (result != SUCCESS) return result;
+        }
+        t->hdr.flags |= BT_FLAG_BLOOM;
+        t->hdr.bloom_bits = bits_per_key;
+        if (io_write_header(t->fd, &t->hdr) < 0) return ERROR_IO;
+        return SUCCESS;
+    }
+
+    // rebuild the filter from the tree with the new setting
+    lock_enter(t, 1);
+    t->hdr.flags |= BT_FLAG_BLOOM;
+    t->hdr.bloom_bits = bits_per_key;
+    bloom_rebuild(t);
+
+    // save it for the current generation, then record it in the header
+    char bloom_path[4096];
+    sidecar_path(t, "bloom", bloom_path, sizeof(bloom_path));
+    int result = SUCCESS;
+    if (bloom_save(t->bloom, bloom_path, t->hdr.generation) < 0 || lock_publish(t) < 0) {
+        result = ERROR_IO;
+    }
+    lock_leave(t);
+    return result;
+}
+
+int bt_freeze(BTree *t, const char *path) {
+    return frozen_write(t, path);
+}
+
+int bt_enable_value_index(BTree *t) {
+    if (t->hdr.flags & BT_FLAG_FROZEN) return ERROR_UNSUPPORTED;
+
+    // every shard indexes its own pairs
+    if (t->shards) {
+        for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+            int result = bt_enable_value_index(t->shards[i]);
+            if (result != SUCCESS) return result;
+        }
+        t->hdr.flags |= BT_FLAG_VALUES;
+        if (io_write_header(t->fd, &t->hdr) < 0) return ERROR_IO;
+        return SUCCESS;
+    }
+
+    // readers open the secondary once the flag is published
+    lock_enter(t, 1);
+    vindex_build(t);
+    t->hdr.flags |= BT_FLAG_VALUES;
+    int result = lock_publish(t) < 0 ? ERROR_IO : SUCCESS;
+    lock_leave(t);
+    return result;
+}
+
+int bt_merge(BTree *a, BTree *b, const char *path, int policy) {
+    return merge_write(a, b, path, policy);
+}
+
+int bt_set_cache_size(BTree *t, uint64_t blocks) {
+    if (blocks == 0 || !(t->hdr.flags & BT_FLAG_DIRECT)) return ERROR_UNSUPPORTED;
+
+    // every shard keeps its own cache
+    if (t->shards) {
+        for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+            int result = bt_set_cache_size(t->shards[i], blocks);
+            if (result != SUCCESS) return result;
+        }
+        t->hdr.cache_blocks = blocks;
+        if (io_write_header(t->fd, &t->hdr) < 0) return ERROR_IO;
+        return SUCCESS;
+    }
+
+    // the file is always current, so the old cache can simply be dropped
+    lock_enter(t, 1);
+    warm_stop(t);
+    cache_free(t->cache);
+    t->cache = cache_new(blocks);
+    t->hdr.cache_blocks = blocks;
+    int result = lock_publish(t) < 0 ? ERROR_IO : SUCCESS;
+    lock_leave(t);
+    return result;
+}
+
+uint64_t tree_count_below(BTree *t, uint64_t key, int inclusive) {
+    BTNode node;
+    uint64_t count = 0;
+    uint64_t current_node_id = t->hdr.root_block;
+
+    while (1) {
+        read_node(t, current_node_id, &node);
+
+        // skip the keys that are below the bound
+        int i = 0;
+        while (i < node.n && (node.keys[i] < key || (inclusive && node.keys[i] == key))) {
+            i++;
+        }
+        count += i;
+
+        // a leaf holds no subtrees
+        if (node.children[0] == 0) return count;
+
+        // whole subtrees left of the bound are counted without reading them
+        for (int j = 0; j < i; j++) count += node.counts[j];
+        current_node_id = node.children[i];
+    }
+}
+
+int bt_rank(BTree *t, uint64_t key, uint64_t *rank) {
+    if (!(t->hdr.flags & BT_FLAG_COUNTED)) return ERROR_UNSUPPORTED;
+
+    // the shards split the keys, so their ranks add up
+    if (t->shards) {
+        shard_enter_all(t);
+        *rank = shard_count_below(t, key, 0);
+        shard_leave_all(t);
+        return SUCCESS;
+    }
+    lock_enter(t, 0);
+    *rank = tree_count_below(t, key, 0);
+    lock_leave(t);
+    return SUCCESS;
+}
+
+int bt_count_range(BTree *t, uint64_t low, uint64_t high, uint64_t *count) {
+    if (!(t->hdr.flags & BT_FLAG_COUNTED)) return ERROR_UNSUPPORTED;
+    if (low > high) {
+        *count = 0;
+        return SUCCESS;
+    }
+    if (t->shards) {
+        // one answer counts one version of every shard
+        shard_enter_all(t);
+        *count = shard_count_below(t, high, 1) - shard_count_below(t, low, 0);
+        shard_leave_all(t);
+        return SUCCESS;
+    }
+    lock_enter(t, 0);
+    *count = tree_count_below(t, high, 1) - tree_count_below(t, low, 0);
+    lock_leave(t);
+    return SUCCESS;
+}
+
+int tree_select(BTree *t, uint64_t k, uint64_t *key, uint64_t *value) {
+    BTNode node;
+    read_node(t, t->hdr.root_block, &node);
+    if (k >= node_total(&node)) return ERROR_KEY_NOT_FOUND;
+
+    // descend until the k-th entry is a key of the current node
+    while (node.children[0] != 0) {
+        int i = 0;
+        while (k >= node.counts[i]) {
+            // skip the whole subtree of child i
+            k -= node.counts[i];
+            // the separator key right after it
+            if (k == 0) {
+                *key = node.keys[i];
+                if (value != NULL) *value = node.values[i];
+                return SUCCESS;
+            }
+            k--;
+            i++;
+        }
+        read_node(t, node.children[i], &node);
+    }
+
+    // the k-th entry of a leaf is stored directly
+    *key = node.keys[k];
+    if (value != NULL) *value = node.values[k];
+    return SUCCESS;
+}
+
+int bt_select(BTree *t, uint64_t k, uint64_t *key, uint64_t *value) {
+    if (!(t->hdr.flags & BT_FLAG_COUNTED)) return ERROR_UNSUPPORTED;
+    if (t->shards) return shard_select(t, k, key, value);
+
+    lock_enter(t, 0);
+    int result = tree_select(t, k, key, value);
+    lock_leave(t);
     return result;
 }
 
 void bt_print(BTree *t) {
+    // print every shard in turn
+    if (t->shards) {
+        printf("Sharded Index: %llu shards\n", (unsigned long long)t->hdr.shard_count);
+        for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+            printf("============================\n");
+            printf("Shard %llu\n", (unsigned long long)i);
+            bt_print(t->shards[i]);
+        }
+        return;
+    }
+
+    if (t->hdr.flags & BT_FLAG_FROZEN) {
+        frozen_print(t);
+        return;
+    }
+    lock_enter(t, 0);
+
     printf("B-Tree Root Block: %llu\n", (unsigned long long)t->hdr.root_block);
     printf("B-Tree Next Free Block: %llu\n", (unsigned long long)t->hdr.next_free_block);
+    printf("B-Tree Generation: %llu%s\n", (unsigned long long)t->hdr.generation,
+           (t->hdr.flags & BT_FLAG_COW) ? " (copy-on-write)" : "");
+    if (t->hdr.flags & BT_FLAG_HASH) {
+        printf("Hash Directory: depth %llu, %llu entries (root block)\n",
+               (unsigned long long)t->hdr.hash_depth, 1ULL << t->hdr.hash_depth);
+    }
+    if (t->hdr.flags & BT_FLAG_COUNTED) {
+        BTNode root;
+        read_node(t, t->hdr.root_block, &root);
+        printf("B-Tree Entries: %llu (counted)\n", (unsigned long long)node_total(&root));
+    }
+    if (t->bloom) {
+        printf("Bloom Filter: %llu bits/key, %llu keys, %llu lookups filtered, %llu false positives\n",
+               (unsigned long long)t->bloom->bits_per_key,
+               (unsigned long long)t->bloom->nkeys,
+               (unsigned long long)t->bloom->filtered,
+               (unsigned long long)t->bloom->false_positives);
+    } else if (t->hdr.flags & BT_FLAG_BLOOM) {
+        printf("Bloom Filter: stale, rebuilt by the next write\n");
+    }
+    if (t->cache) {
+        printf("Block Cache: %llu blocks, %llu hits, %llu misses (direct I/O)\n",
+               (unsigned long long)t->cache->capacity,
+               (unsigned long long)t->cache->hits,
+               (unsigned long long)t->cache->misses);
+    }
     printf("----------------------------\n");
     
     // start printing from the root
-    print_node(t, t->hdr.root_block, 0);
+    if (t->hdr.flags & BT_FLAG_HASH) hash_print(t);
+    else print_node(t, t->hdr.root_block, 0);
+    lock_leave(t);
 }
 
-static void split_child(BTree *t, uint64_t parent_id, int idx) {
-    // declare nodes
-    BTNode parent, child, sibling;
-    // read parent
-    read_node(t, parent_id, &parent);
-    // read child
-    uint64_t child_id = parent.children[idx];
-    read_node(t, child_id, &child);
+void split_node(BTree *t, BTNode *parent, int idx, BTNode *child, BTNode *sibling, uint64_t sib_id) {
+    int degree = child->children[0] == 0 ? t->leaf_degree : t->degree;
 
-    // allocate sibling & set to 0
-    uint64_t sib_id = alloc_node(t);
-    memset(&sibling, 0, sizeof(sibling));
+    // set sibling to 0
+    memset(sibling, 0, sizeof(*sibling));
 
     // set sibling id, parent id, and n
-    sibling.block_id = sib_id;
-    sibling.parent_id = parent_id;
-    sibling.n = DEGREE - 1;
+    sibling->block_id = sib_id;
+    sibling->parent_id = parent->block_id;
+    sibling->n = degree - 1;
 
     // move keys and values
-    for (int j = 0; j < DEGREE-1; j++) {
-        sibling.keys[j] = child.keys[j + DEGREE];
-        sibling.values[j] = child.values[j + DEGREE];
+    for (int j = 0; j < degree-1; j++) {
+        sibling->keys[j] = child->keys[j + degree];
+        sibling->values[j] = child->values[j + degree];
         // zero out the moved keys/values in the child
-        child.keys[j + DEGREE] = 0;
-        child.values[j + DEGREE] = 0;
+        child->keys[j + degree] = 0;
+        child->values[j + degree] = 0;
     }
 
     // if child has children
-    if (child.children[0] != 0) { 
+    if (child->children[0] != 0) { 
         // for each grandchild
-        for (int j = 0; j < DEGREE; j++) {
-            // move grandchild
-            sibling.children[j] = child.children[j + DEGREE];
-            
-            // if grandchild has children
-            if (sibling.children[j] != 0) {
-                // update the parent pointer of the moved grandchild
-                BTNode moved_child;
-                read_node(t, sibling.children[j], &moved_child);
-                moved_child.parent_id = sib_id;
-                write_node(t, sibling.children[j], &moved_child);
-            }
-            
+        for (int j = 0; j < degree; j++) {
+            // move grandchild and its subtree size
+            sibling->children[j] = child->children[j + degree];
+            sibling->counts[j] = child->counts[j + degree];
             // zero out the moved children in the child
-            child.children[j + DEGREE] = 0;
+            child->children[j + degree] = 0;
+            child->counts[j + degree] = 0;
         }
     }
 
     // set child n
-    child.n = DEGREE - 1;
+    child->n = degree - 1;
 
     // shift parent entries
-    for (int j = parent.n; j > idx; j--) {
-        parent.children[j+1] = parent.children[j];
-        parent.keys[j] = parent.keys[j-1];
-        parent.values[j] = parent.values[j-1];
+    for (int j = parent->n; j > idx; j--) {
+        parent->children[j+1] = parent->children[j];
+        parent->counts[j+1] = parent->counts[j];
+        parent->keys[j] = parent->keys[j-1];
+        parent->values[j] = parent->values[j-1];
     }
 
     // set parent children and keys
-    parent.children[idx+1] = sib_id;
-    parent.keys[idx] = child.keys[DEGREE-1];
-    parent.values[idx] = child.values[DEGREE-1];
-    parent.n++;
+    parent->children[idx+1] = sib_id;
+    parent->keys[idx] = child->keys[degree-1];
+    parent->values[idx] = child->values[degree-1];
+    parent->n++;
 
     // zero out the moved keys/values in the child
-    child.keys[DEGREE-1] = 0;
-    child.values[DEGREE-1] = 0;
+    child->keys[degree-1] = 0;
+    child->values[degree-1] = 0;
+
+    // the median moved up, so both halves are recounted
+    parent->counts[idx] = node_total(child);
+    parent->counts[idx+1] = node_total(sibling);
+
+    // pending messages follow their keys (equal keys go right, like inserts)
+    int kept = 0;
+    for (int j = 0; j < child->nmsgs; j++) {
+        int dest_left = child->msg_keys[j] < parent->keys[idx];
+        BTNode *dest = dest_left ? child : sibling;
+        int pos = dest_left ? kept++ : sibling->nmsgs++;
+        dest->msg_keys[pos] = child->msg_keys[j];
+        dest->msg_values[pos] = child->msg_values[j];
+        dest->msg_types[pos] = child->msg_types[j];
+    }
+    child->nmsgs = kept;
+}
+
+static void split_child(BTree *t, uint64_t parent_id, int idx) {
+    // declare nodes
+    BTNode parent, child, sibling;
+    // read parent
+    read_node(t, parent_id, &parent);
+    // read child
+    uint64_t child_id = parent.children[idx];
+    read_node(t, child_id, &child);
 
-    // write back
-    write_node(t, child_id, &child);
-    write_node(t, sib_id, &sibling);
-    write_node(t, parent_id, &parent);
+    // allocate sibling and move the upper half of the child into it
+    uint64_t sib_id = alloc_node(t);
+    split_node(t, &parent, idx, &child, &sibling, sib_id);
+
+    // moved grandchildren are read in one batch and written back with the split
+    BTNode moved[DEGREE];
+    uint8_t moved_bufs[DEGREE][BLOCK_SIZE] IO_ALIGNED;
+    IoRequest moved_reqs[DEGREE];
+    int moved_count = 0;
+    if (sibling.children[0] != 0) {
+        moved_count = sibling.n + 1;
+        prefetch_nodes(t, sibling.children, moved_count, moved_bufs, moved_reqs);
+    }
+
+    // update the parent pointer of the moved grandchildren
+    BTNode *dirty[DEGREE + 3];
+    for (int j = 0; j < moved_count; j++) {
+        wait_node(t, &moved_reqs[j], &moved[j]);
+        moved[j].parent_id = sib_id;
+        dirty[j] = &moved[j];
+    }
+
+    // write back everything touched by the split in one batch
+    dirty[moved_count] = &child;
+    dirty[moved_count + 1] = &sibling;
+    dirty[moved_count + 2] = &parent;
+    write_nodes(t, dirty, moved_count + 3);
 }
 
 static void insert_nonfull(BTree *t, uint64_t node_id, uint64_t key, uint64_t value) {
@@ -396,17 +1389,8 @@ static void insert_nonfull(BTree *t, uint64_t node_id, uint64_t key, uint64_t va
 
     // if node is leaf
     if (node.children[0] == 0) {
-        // shift keys and values to make room for new entry
-        while (i >= 0 && key < node.keys[i]) {
-            node.keys[i+1] = node.keys[i];
-            node.values[i+1] = node.values[i];
-            i--;
-        }
-
         // insert the new key and value
-        node.keys[i+1] = key;
-        node.values[i+1] = value;
-        node.n++;
+        leaf_insert(&node, key, value);
 
         // write back the updated node
         write_node(t, node_id, &node);
@@ -420,7 +1404,7 @@ static void insert_nonfull(BTree *t, uint64_t node_id, uint64_t key, uint64_t va
         read_node(t, node.children[i], &child);
 
         // if child is full
-        if (child.n == MAX_KEYS) {
+        if (node_full(t, &child)) {
             // split it
             split_child(t, node_id, i);
 
@@ -428,6 +1412,14 @@ static void insert_nonfull(BTree *t, uint64_t node_id, uint64_t key, uint64_t va
             read_node(t, node_id, &node);
             if (key > node.keys[i]) i++;
         }
+
+        // the new entry ends up below this child
+        if (t->hdr.flags & BT_FLAG_COUNTED) {
+            node.counts[i]++;
+            write_node(t, node_id, &node);
+        } else {
+            touch_node(t, &node);
+        }
         // recursively insert into the appropriate child
         insert_nonfull(t, node.children[i], key, value);
     }
@@ -450,10 +1442,13 @@ static void print_node(BTree *t, uint64_t node_id, int level) {
     printf("L%d ", level);
     
     // print node information
-    printf("Node[%llu] (parent=%llu, n=%llu): ", 
+    printf("Node[%llu] (parent=%llu, n=%llu", 
            (unsigned long long)node.block_id,
            (unsigned long long)node.parent_id,
            (unsigned long long)node.n);
+    printf(", gen=%llu/%llu", (unsigned long long)node.gen, (unsigned long long)node.max_gen);
+    if (node.nmsgs > 0) printf(", pending=%llu", (unsigned long long)node.nmsgs);
+    printf("): ");
     
     // print keys and values
     for (int i = 0; i < node.n; i++) {
@@ -476,44 +1471,289 @@ static void print_node(BTree *t, uint64_t node_id, int level) {
     }
 }
 
-static int extract_node(BTree *t, FILE *file, uint64_t node_id, int *pair_count) {
-    // load the current node
-    BTNode node;
-    read_node(t, node_id, &node);
+static void scan_node(BTree *t, const BTNode *node, uint64_t min_gen, ScanFn fn, void *ctx) {
+    // entries of the node are only visited if they changed recently enough
+    int visit = node->gen >= min_gen;
 
     // if this is a leaf node
-    if (node.children[0] == 0) {
-        // for each key-value pair
-        for (int i = 0; i < node.n; i++) {
-            // write key-value pair to csv file
-            fprintf(file, "%llu,%llu\n", 
-                    (unsigned long long)node.keys[i], 
-                    (unsigned long long)node.values[i]);    
-            (*pair_count)++;
+    if (node->children[0] == 0) {
+        // visit each key-value pair
+        for (int i = 0; visit && i < node->n; i++) {
+            fn(ctx, node->keys[i], node->values[i]);
         }
+        return;
+    }
+
+    // submit reads for all children at once, so later children arrive
+    // while the earlier subtrees are still being visited
+    BTNode *kids = malloc(MAX_CHILDREN * sizeof(BTNode));
+    uint8_t (*bufs)[BLOCK_SIZE] = io_alloc(MAX_CHILDREN * BLOCK_SIZE);
+    IoRequest reqs[MAX_CHILDREN];
+    if (!kids || !bufs) die("malloc");
+    prefetch_nodes(t, node->children, node->n + 1, bufs, reqs);
+
+    // for internal nodes, traverse children and visit keys in order,
+    // skipping subtrees that did not change since min_gen
+    for (int i = 0; i < node->n; i++) {
+        // traverse the left child
+        wait_node(t, &reqs[i], &kids[i]);
+        if (kids[i].max_gen >= min_gen) scan_node(t, &kids[i], min_gen, fn, ctx);
+        
+        // visit the current key-value pair
+        if (visit) fn(ctx, node->keys[i], node->values[i]);
+    }
+
+    // traverse the rightmost child
+    wait_node(t, &reqs[node->n], &kids[node->n]);
+    if (kids[node->n].max_gen >= min_gen) scan_node(t, &kids[node->n], min_gen, fn, ctx);
+
+    io_free(bufs, MAX_CHILDREN * BLOCK_SIZE);
+    free(kids);
+}
+
+static void scan_tree(BTree *t, uint64_t min_gen, ScanFn fn, void *ctx) {
+    // snapshots and hash indexes keep no generations per block, so they are
+    // visited whole if anything changed since min_gen
+    if ((t->hdr.flags & (BT_FLAG_FROZEN | BT_FLAG_HASH)) && t->hdr.generation < min_gen) return;
+
+    // snapshots store their pairs in key order already
+    if (t->hdr.flags & BT_FLAG_FROZEN) {
+        frozen_scan(t, fn, ctx);
+        return;
+    }
+
+    // hash indexes have no key order, their buckets are visited instead
+    if (t->hdr.flags & BT_FLAG_HASH) {
+        hash_scan(t, fn, ctx);
+        return;
+    }
+
+    // pending messages are resolved on the way, without writing them down
+    if (t->hdr.flags & BT_FLAG_BUFFERED) {
+        buffer_scan(t, min_gen, fn, ctx);
+        return;
+    }
+
+    // start traversal from the root node
+    BTNode root;
+    read_node(t, t->hdr.root_block, &root);
+    if (root.max_gen >= min_gen) scan_node(t, &root, min_gen, fn, ctx);
+}
+
+// helper to append a key to a list (scan callback)
+static void collect_key(void *ctx, uint64_t key, uint64_t value) {
+    key_list_add(ctx, key);
+}
+
+void bloom_rebuild(BTree *t) {
+    KeyList list = {0};
+    lock_enter(t, 0);
+    scan_tree(t, 0, collect_key, &list);
+    lock_leave(t);
+
+    // leave room for the tree to double before the next rebuild
+    Bloom *bf = bloom_new(list.count * 2, t->hdr.bloom_bits);
+    for (size_t i = 0; i < list.count; i++) bloom_add(bf, list.keys[i]);
+    free(list.keys);
+
+    // keep the lookup counters across rebuilds
+    if (t->bloom) {
+        bf->filtered = t->bloom->filtered;
+        bf->false_positives = t->bloom->false_positives;
+        bloom_free(t->bloom);
+    }
+    t->bloom = bf;
+}
+
+// deepest tree a cursor can walk (far beyond any file that fits on disk)
+#define CURSOR_MAX_DEPTH 32
+
+// node on the path of a cursor
+typedef struct {
+    BTNode node;
+    int    pos;     // next key to return (its left subtree is done)
+} CursorFrame;
+
+struct BTCursor {
+    BTree       *t;
+    CursorFrame  path[CURSOR_MAX_DEPTH];
+    int          depth;
+
+    // sharded index: one cursor per shard and its current entry
+    BTCursor   **subs;
+    int         *has;
+    uint64_t    *keys;
+    uint64_t    *values;
+
+    // hash index: every pair, sorted by key when the cursor was opened;
+    // buffered index: the pairs the view resolved and next has not returned
+    uint64_t   (*pairs)[2];
+    size_t       npairs;
+    size_t       cap;
+    size_t       next;
+    BufferView  *view;
+    int          view_done;
+
+    // frozen snapshot: page of the next position (next is the position)
+    uint8_t     *page;
+};
+
+// helper to append a pair to a hash or buffered cursor (scan callback)
+static void cursor_collect(void *ctx, uint64_t key, uint64_t value) {
+    BTCursor *c = ctx;
+    if (c->npairs == c->cap) {
+        c->cap = c->cap ? c->cap * 2 : 1024;
+        c->pairs = realloc(c->pairs, c->cap * sizeof(*c->pairs));
+        if (!c->pairs) die("realloc");
+    }
+    c->pairs[c->npairs][0] = key;
+    c->pairs[c->npairs][1] = value;
+    c->npairs++;
+}
+
+// helper to order collected pairs by key
+static int compare_pair_keys(const void *a, const void *b) {
+    uint64_t x = ((const uint64_t *)a)[0], y = ((const uint64_t *)b)[0];
+    return x < y ? -1 : x > y;
+}
+
+// helper to descend from a node to the leftmost leaf below it
+static void cursor_push(BTCursor *c, uint64_t id) {
+    while (1) {
+        if (c->depth == CURSOR_MAX_DEPTH) die("tree too deep");
+        CursorFrame *f = &c->path[c->depth++];
+        read_node(c->t, id, &f->node);
+        f->pos = 0;
+        if (c->view) buffer_view_node(c->view, &f->node, c->depth - 1);
+        if (f->node.children[0] == 0) return;
+        id = f->node.children[0];
+    }
+}
+
+BTCursor* bt_cursor_open(BTree *t) {
+    BTCursor *c = calloc(1, sizeof(*c));
+    if (!c) die("calloc");
+    c->t = t;
+
+    if (t->shards) {
+        // prime one cursor per shard
+        uint64_t n = t->hdr.shard_count;
+        c->subs = calloc(n, sizeof(BTCursor *));
+        c->has = calloc(n, sizeof(int));
+        c->keys = calloc(n, sizeof(uint64_t));
+        c->values = calloc(n, sizeof(uint64_t));
+        if (!c->subs || !c->has || !c->keys || !c->values) die("calloc");
+        for (uint64_t i = 0; i < n; i++) {
+            c->subs[i] = bt_cursor_open(t->shards[i]);
+            c->has[i] = bt_cursor_next(c->subs[i], &c->keys[i], &c->values[i]) == SUCCESS;
+        }
+        return c;
+    }
+
+    // the cursor reads one version of the tree until it is closed
+    lock_enter(t, 0);
+
+    if (t->hdr.flags & BT_FLAG_FROZEN) {
+        // pages are walked in place
+        c->page = io_alloc(BLOCK_SIZE);
+        if (!c->page) die("malloc");
+        return c;
+    }
+
+    if (t->hdr.flags & BT_FLAG_HASH) {
+        // buckets have no key order, so the pairs are sorted up front
+        hash_scan(t, cursor_collect, c);
+        qsort(c->pairs, c->npairs, sizeof(*c->pairs), compare_pair_keys);
+        return c;
+    }
+
+    // buffered trees are read through a view that applies pending messages
+    if (t->hdr.flags & BT_FLAG_BUFFERED) c->view = buffer_view_new(0, UINT64_MAX, cursor_collect, c);
+    cursor_push(c, t->hdr.root_block);
+    return c;
+}
+
+// helper to walk the tree to its next stored entry and the depth of its node
+static int cursor_step(BTCursor *c, uint64_t *key, uint64_t *value, int *depth) {
+    while (c->depth > 0) {
+        CursorFrame *f = &c->path[c->depth - 1];
+        // this node is done, go back to its parent
+        if (f->pos >= f->node.n) {
+            c->depth--;
+            continue;
+        }
+
+        // return the next key, then step into the subtree to its right
+        *key = f->node.keys[f->pos];
+        *value = f->node.values[f->pos];
+        *depth = c->depth - 1;
+        f->pos++;
+        if (f->node.children[0] != 0) cursor_push(c, f->node.children[f->pos]);
         return SUCCESS;
     }
+    return ERROR_KEY_NOT_FOUND;
+}
 
-    // for internal nodes, traverse children and write keys in order
-    for (int i = 0; i < node.n; i++) {
-        // if left child exists
-        if (node.children[i] != 0) {
-            // traverse the left child
-            extract_node(t, file, node.children[i], pair_count);
+int bt_cursor_next(BTCursor *c, uint64_t *key, uint64_t *value) {
+    if (c->subs) {
+        // take the smallest head among the shards (there are only a few)
+        int best = -1;
+        for (uint64_t i = 0; i < c->t->hdr.shard_count; i++) {
+            if (c->has[i] && (best < 0 || c->keys[i] < c->keys[best])) best = i;
         }
-        
-        // write the current key-value pair
-        fprintf(file, "%llu,%llu\n", 
-                (unsigned long long)node.keys[i], 
-                (unsigned long long)node.values[i]);
-        (*pair_count)++;
+        if (best < 0) return ERROR_KEY_NOT_FOUND;
+
+        *key = c->keys[best];
+        *value = c->values[best];
+        c->has[best] = bt_cursor_next(c->subs[best], &c->keys[best], &c->values[best]) == SUCCESS;
+        return SUCCESS;
     }
 
-    // if rightmost child exists
-    if (node.children[node.n] != 0) {
-        // traverse the rightmost child
-        extract_node(t, file, node.children[node.n], pair_count);
+    if (c->page) {
+        int result = frozen_next(c->t, c->next, c->page, key, value);
+        if (result == SUCCESS) c->next++;
+        return result;
     }
 
-    return SUCCESS;
-}
\ No newline at end of file
+    // the view hands out a key once no later entry can change it
+    while (c->view && c->next == c->npairs) {
+        c->next = c->npairs = 0;
+        int depth;
+        if (cursor_step(c, key, value, &depth) == SUCCESS) {
+            buffer_view_pair(c->view, *key, *value, depth, 1);
+        } else if (!c->view_done) {
+            buffer_view_finish(c->view);
+            c->view_done = 1;
+        } else {
+            return ERROR_KEY_NOT_FOUND;
+        }
+    }
+
+    if (c->view || (c->t->hdr.flags & BT_FLAG_HASH)) {
+        if (c->next == c->npairs) return ERROR_KEY_NOT_FOUND;
+        *key = c->pairs[c->next][0];
+        *value = c->pairs[c->next][1];
+        c->next++;
+        return SUCCESS;
+    }
+
+    int depth;
+    return cursor_step(c, key, value, &depth);
+}
+
+void bt_cursor_close(BTCursor *c) {
+    if (!c) return;
+    if (c->subs) {
+        for (uint64_t i = 0; i < c->t->hdr.shard_count; i++) bt_cursor_close(c->subs[i]);
+        free(c->subs);
+        free(c->has);
+        free(c->keys);
+        free(c->values);
+    } else {
+        lock_leave(c->t);
+    }
+    buffer_view_free(c->view);
+    free(c->pairs);
+    io_free(c->page, BLOCK_SIZE);
+    free(c);
+}
@@ -1,8 +1,13 @@
 #ifndef BTREE_H
 #define BTREE_H
 
+#include <stddef.h>
 #include <stdint.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Header file for the B-tree
  */
@@ -15,12 +20,27 @@ typedef struct BTree BTree;
 /**
  * Create a new B-tree index file.
  * @param filename  Path to the index file to create.
+ * @param flags     Index mode flags (BT_FLAG_* from constants.h), 0 for a plain tree.
  * @return          Pointer to a BTree handle, or NULL on error.
  */
-BTree* bt_create(const char *filename);
+BTree* bt_create(const char *filename, uint64_t flags);
+
+/**
+ * Create a sharded index: a manifest file plus shard_count B-tree files
+ * named <filename>.shard<i>. Keys are routed to a shard by hash, so
+ * point operations touch a single shard and loads build the shards in
+ * parallel threads.
+ * @param filename      Path to the manifest file to create.
+ * @param flags         Index mode flags applied to every shard.
+ * @param shard_count   Number of shards (0 creates a plain index).
+ * @return              Pointer to a BTree handle, or NULL on error.
+ */
+BTree* bt_create_sharded(const char *filename, uint64_t flags, uint64_t shard_count);
 
 /**
  * Open an existing B-tree index file.
+ * For copy-on-write files the handle sees the snapshot that was current
+ * when it was opened, and that snapshot stays intact until bt_close.
  * @param filename  Path to the index file to open.
  * @return          Pointer to a BTree handle, or NULL on error.
  */
@@ -41,6 +61,28 @@ void bt_close(BTree *tree);
  */
 int bt_insert(BTree *tree, uint64_t key, uint64_t value);
 
+/**
+ * Insert a batch of key-value pairs into the B-tree.
+ * The batch is sorted and merged in a single walk of the tree, so each
+ * node it touches is read and written once.
+ * @param tree      The BTree handle.
+ * @param keys      Keys to insert, in any order.
+ * @param values    Values to associate with the keys.
+ * @param count     Number of pairs.
+ * @return          0 on success, non-zero on failure.
+ */
+int bt_insert_batch(BTree *tree, const uint64_t *keys, const uint64_t *values, size_t count);
+
+/**
+ * Set the value of a key, inserting it if it is not in the B-tree.
+ * With duplicate keys, the copy bt_search would return is replaced.
+ * @param tree      The BTree handle.
+ * @param key       64-bit key to update or insert.
+ * @param value     64-bit value to associate with the key.
+ * @return          0 on success, non-zero on failure.
+ */
+int bt_upsert(BTree *tree, uint64_t key, uint64_t value);
+
 /**
  * Search for a key in the B-tree.
  * @param tree      The BTree handle.
@@ -72,4 +114,148 @@ int bt_load(BTree *tree, const char *csv_file);
  */
 int bt_extract(BTree *tree, const char *csv_file);
 
+/**
+ * Extract the key-value pairs of the nodes written after a generation.
+ * Subtrees untouched since then are skipped without being read, so a small
+ * change costs a few node reads. The output holds every pair of a changed
+ * node, so it is a superset of the pairs inserted or updated since.
+ * @param tree      The BTree handle.
+ * @param csv_file  Path to the CSV file to write key-value pairs to.
+ * @param since     Generation of the previous export.
+ * @return          SUCCESS on success, ERROR_UNSUPPORTED for sharded indexes,
+ *                  non-zero on other failures.
+ */
+int bt_extract_since(BTree *tree, const char *csv_file, uint64_t since);
+
+/**
+ * Find the keys that are stored with a value, through the secondary value
+ * index (<index_file>.vidx). Each key found there is checked against the
+ * index itself, so keys whose value was replaced are not returned.
+ * @param tree      The BTree handle.
+ * @param value     Value to look for.
+ * @param keys      Pointer to store a malloc'd array of distinct keys, in
+ *                  increasing order; the caller frees it.
+ * @param count     Pointer to store the number of keys.
+ * @return          SUCCESS, ERROR_KEY_NOT_FOUND if no key has the value, or
+ *                  ERROR_UNSUPPORTED if the index has no value index.
+ */
+int bt_search_value(BTree *tree, uint64_t value, uint64_t **keys, size_t *count);
+
+/**
+ * Build (or rebuild) the secondary value index of an existing index, and
+ * keep it up to date from then on. Rebuilding drops the entries left behind
+ * by upserts.
+ * @param tree      The BTree handle.
+ * @return          SUCCESS on success, ERROR_UNSUPPORTED for frozen snapshots.
+ */
+int bt_enable_value_index(BTree *tree);
+
+/**
+ * Build (or rebuild) the Bloom filter sidecar (<index_file>.bloom) that
+ * lets bt_search reject missing keys without reading the tree.
+ * @param tree          The BTree handle.
+ * @param bits_per_key  Filter bits per key (10 gives about 1% false positives).
+ * @return              SUCCESS on success, non-zero on failure.
+ */
+int bt_enable_bloom(BTree *tree, uint64_t bits_per_key);
+
+/**
+ * Write a read-only snapshot of the index: its pairs in sorted pages plus a
+ * small piecewise-linear model, kept in memory by bt_open, that predicts
+ * the page of a key. Lookups in the snapshot read at most two blocks.
+ * @param tree          The BTree handle.
+ * @param path          Path of the snapshot file to create.
+ * @return              SUCCESS, or ERROR_FILE_EXISTS if the path is taken.
+ */
+int bt_freeze(BTree *tree, const char *path);
+
+/**
+ * Merge two indexes into a new index, reading each input once in key order
+ * and building the output bottom-up. The output uses the node layout and
+ * options of the first index (a plain B-tree for hash, frozen and sharded
+ * indexes).
+ * @param a             Handle of the first index.
+ * @param b             Handle of the second index.
+ * @param path          Path of the index file to create.
+ * @param policy        What to keep of a key present in both indexes:
+ *                      BT_MERGE_BOTH, BT_MERGE_FIRST or BT_MERGE_SECOND.
+ * @return              SUCCESS, or ERROR_FILE_EXISTS if the path is taken.
+ */
+int bt_merge(BTree *a, BTree *b, const char *path, int policy);
+
+/**
+ * Resize the block cache of an index created in direct I/O mode. The size
+ * is recorded in the header and used by every later open.
+ * @param tree          The BTree handle.
+ * @param blocks        Number of blocks to cache.
+ * @return              SUCCESS, or ERROR_UNSUPPORTED if the index does not use
+ *                      direct I/O.
+ */
+int bt_set_cache_size(BTree *tree, uint64_t blocks);
+
+/**
+ * Count the entries with a key smaller than the given key. Needs an index
+ * created in counted mode.
+ * @param tree      The BTree handle.
+ * @param key       64-bit key to rank.
+ * @param rank      Pointer to store the number of smaller entries.
+ * @return          SUCCESS, or ERROR_UNSUPPORTED if the index is not counted.
+ */
+int bt_rank(BTree *tree, uint64_t key, uint64_t *rank);
+
+/**
+ * Find the entry at a position of the key order. Needs an index created in
+ * counted mode.
+ * @param tree      The BTree handle.
+ * @param k         0-based position of the entry.
+ * @param key       Pointer to store the key of the entry.
+ * @param value     Pointer to store the value of the entry (may be NULL).
+ * @return          SUCCESS, ERROR_KEY_NOT_FOUND if k is past the last entry,
+ *                  or ERROR_UNSUPPORTED if the index is not counted.
+ */
+int bt_select(BTree *tree, uint64_t k, uint64_t *key, uint64_t *value);
+
+/**
+ * Count the entries with a key in [low, high]. Needs an index created in
+ * counted mode.
+ * @param tree      The BTree handle.
+ * @param low       Smallest key to count.
+ * @param high      Largest key to count.
+ * @param count     Pointer to store the number of entries.
+ * @return          SUCCESS, or ERROR_UNSUPPORTED if the index is not counted.
+ */
+int bt_count_range(BTree *tree, uint64_t low, uint64_t high, uint64_t *count);
+
+/**
+ * In-order cursor over the entries of a B-tree (merged across the shards of
+ * a sharded index).
+ */
+typedef struct BTCursor BTCursor;
+
+/**
+ * Open a cursor positioned before the smallest key.
+ * @param tree      The BTree handle (must stay open while the cursor is used).
+ * @return          Pointer to a cursor.
+ */
+BTCursor* bt_cursor_open(BTree *tree);
+
+/**
+ * Move the cursor to the next entry in key order.
+ * @param cursor    The cursor.
+ * @param key       Pointer to store the key.
+ * @param value     Pointer to store the value.
+ * @return          SUCCESS, or ERROR_KEY_NOT_FOUND after the last entry.
+ */
+int bt_cursor_next(BTCursor *cursor, uint64_t *key, uint64_t *value);
+
+/**
+ * Free a cursor.
+ * @param cursor    The cursor (may be NULL).
+ */
+void bt_cursor_close(BTCursor *cursor);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* BTREE_H */
\ No newline at end of file
@@ -0,0 +1,492 @@
+#ifndef BTREE_HPP
+#define BTREE_HPP
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstddef>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "constants.h"
+#include "io.h"
+
+/**
+ * Header-only C++17 B-tree with the node layout chosen at compile time.
+ *
+ * BTree<Key, Value, BlockSize, Compare> stores fixed-size keys and values
+ * in BlockSize-byte nodes and computes the degree from their sizes, so a
+ * table of 32-bit keys gets a much larger fanout than the C layout and a
+ * table of 16-byte values still fits in a block. Files use the same header
+ * and I/O layer (io.c) as the C library, with BT_FLAG_TYPED set and the
+ * key, value and block sizes recorded, so each side refuses the other's
+ * files. Programs using it link io.o and utils.o.
+ *
+ * Integer keys and values are stored big-endian like the C format; other
+ * trivially copyable types are stored as their raw bytes. Errors are
+ * reported with exceptions.
+ */
+
+namespace btree {
+
+namespace detail {
+
+// helper to store a field at p (integers big-endian, anything else raw)
+template <typename T>
+inline void store(uint8_t *p, const T &v) {
+    if constexpr (std::is_integral_v<T>) {
+        using U = std::make_unsigned_t<T>;
+        U x = static_cast<U>(v);
+        for (std::size_t i = 0; i < sizeof(T); ++i) {
+            p[sizeof(T) - 1 - i] = static_cast<uint8_t>(x & 0xff);
+            if constexpr (sizeof(T) > 1) x >>= 8;
+        }
+    } else {
+        std::memcpy(p, &v, sizeof(T));
+    }
+}
+
+// helper to load a field stored by store()
+template <typename T>
+inline T load(const uint8_t *p) {
+    if constexpr (std::is_integral_v<T>) {
+        using U = std::make_unsigned_t<T>;
+        U x = 0;
+        for (std::size_t i = 0; i < sizeof(T); ++i) {
+            if constexpr (sizeof(T) > 1) x <<= 8;
+            x |= p[i];
+        }
+        return static_cast<T>(x);
+    } else {
+        T v;
+        std::memcpy(&v, p, sizeof(T));
+        return v;
+    }
+}
+
+// whether Compare is the plain < of an arithmetic key
+template <typename Key, typename Compare>
+inline constexpr bool plain_less = std::is_arithmetic_v<Key> &&
+    (std::is_same_v<Compare, std::less<Key>> || std::is_same_v<Compare, std::less<>>);
+
+// number of the first n keys that are smaller than key (Inclusive: or equal)
+template <bool Inclusive, typename Key, typename Compare, std::size_t N>
+inline std::size_t rank(const std::array<Key, N> &keys, std::size_t n, const Key &key,
+                        const Compare &cmp) {
+    if constexpr (plain_less<Key, Compare>) {
+        // branchless scan over every slot, which the compiler unrolls for
+        // the fixed node size
+        std::size_t count = 0;
+        for (std::size_t i = 0; i < N; ++i) {
+            bool below = Inclusive ? !(key < keys[i]) : keys[i] < key;
+            count += (i < n) & below;
+        }
+        return count;
+    } else if constexpr (Inclusive) {
+        return std::upper_bound(keys.begin(), keys.begin() + n, key, cmp) - keys.begin();
+    } else {
+        return std::lower_bound(keys.begin(), keys.begin() + n, key, cmp) - keys.begin();
+    }
+}
+
+// helper to throw the current errno for a failed call
+[[noreturn]] inline void throw_errno(const char *what) {
+    throw std::system_error(errno ? errno : EIO, std::generic_category(), what);
+}
+
+} // namespace detail
+
+template <typename Key, typename Value, std::size_t BlockSize = BLOCK_SIZE,
+          typename Compare = std::less<Key>>
+class BTree {
+    static_assert(std::is_trivially_copyable_v<Key> && std::is_trivially_copyable_v<Value>,
+                  "keys and values are stored as fixed-size fields");
+    static_assert(BlockSize >= BLOCK_SIZE && BlockSize % BLOCK_SIZE == 0,
+                  "the block size must be a multiple of the header block");
+
+    // node: block id, number of keys, 2t children, then 2t-1 keys and values
+    static constexpr std::size_t entry_size = sizeof(Key) + sizeof(Value);
+
+public:
+    /**
+     * Minimum degree (t), the largest that fits the node in one block
+     */
+    static constexpr std::size_t degree = (BlockSize - 16 + entry_size) / (2 * (8 + entry_size));
+    static_assert(degree >= 2, "block too small for two keys per node");
+
+    static constexpr std::size_t max_keys = 2 * degree - 1;
+    static constexpr std::size_t max_children = 2 * degree;
+
+    /**
+     * Key, value and block sizes recorded in the header
+     */
+    static constexpr uint64_t layout = static_cast<uint64_t>(sizeof(Key)) |
+                                       static_cast<uint64_t>(sizeof(Value)) << 16 |
+                                       static_cast<uint64_t>(BlockSize) << 32;
+
+    using value_type = std::pair<Key, Value>;
+
+    class iterator;
+
+private:
+    // decoded node
+    struct Node {
+        uint64_t id = 0;
+        std::size_t n = 0;
+        std::array<uint64_t, max_children> children{};
+        std::array<Key, max_keys> keys{};
+        std::array<Value, max_keys> values{};
+
+        bool leaf() const { return children[0] == 0; }
+    };
+
+public:
+    /**
+     * Create a new index file (fails if it exists).
+     * @param path      Path to the index file.
+     * @param cmp       Key order.
+     * @return          Handle that closes the file when destroyed.
+     */
+    static BTree create(const std::string &path, Compare cmp = Compare()) {
+        if (io_file_exists(path.c_str())) {
+            throw std::system_error(EEXIST, std::generic_category(), path);
+        }
+        BTree t(cmp);
+        t.fd_ = io_open(path.c_str(), O_RDWR | O_CREAT);
+        if (t.fd_ < 0) detail::throw_errno("io_open");
+
+        std::memcpy(&t.hdr_.magic, MAGIC_NUMBER, 8);
+        t.hdr_.root_block = 1;
+        t.hdr_.next_free_block = 2;
+        t.hdr_.flags = BT_FLAG_TYPED;
+        t.hdr_.layout = layout;
+        t.dirty_ = true;
+        t.flush();
+
+        // empty root leaf
+        Node root{};
+        root.id = 1;
+        t.write_node(root);
+        return t;
+    }
+
+    /**
+     * Open an index file created with the same Key, Value and BlockSize.
+     * @param path      Path to the index file.
+     * @param cmp       Key order (must match the one used to build it).
+     * @return          Handle that closes the file when destroyed.
+     */
+    static BTree open(const std::string &path, Compare cmp = Compare()) {
+        BTree t(cmp);
+        t.fd_ = io_open(path.c_str(), O_RDWR);
+        if (t.fd_ < 0) detail::throw_errno("io_open");
+        if (io_read_header(t.fd_, &t.hdr_) < 0) detail::throw_errno("io_read_header");
+
+        if (std::memcmp(&t.hdr_.magic, MAGIC_NUMBER, 8) != 0) {
+            throw std::runtime_error(path + ": invalid B-tree file");
+        }
+        if (!(t.hdr_.flags & BT_FLAG_TYPED) || t.hdr_.layout != layout) {
+            throw std::runtime_error(path + ": index has a different node layout");
+        }
+        return t;
+    }
+
+    BTree(BTree &&other) noexcept
+        : fd_(std::exchange(other.fd_, -1)), hdr_(other.hdr_),
+          dirty_(other.dirty_), cmp_(std::move(other.cmp_)) {}
+
+    BTree &operator=(BTree &&other) noexcept {
+        if (this != &other) {
+            close_quietly();
+            fd_ = std::exchange(other.fd_, -1);
+            hdr_ = other.hdr_;
+            dirty_ = other.dirty_;
+            cmp_ = std::move(other.cmp_);
+        }
+        return *this;
+    }
+
+    BTree(const BTree &) = delete;
+    BTree &operator=(const BTree &) = delete;
+
+    ~BTree() { close_quietly(); }
+
+    /**
+     * Write the header if it changed, then close the file.
+     */
+    void close() {
+        if (fd_ < 0) return;
+        flush();
+        io_close(std::exchange(fd_, -1));
+    }
+
+    /**
+     * Write the header if it changed since the last flush.
+     */
+    void flush() {
+        if (!dirty_) return;
+        if (io_write_header(fd_, &hdr_) < 0) detail::throw_errno("io_write_header");
+        dirty_ = false;
+    }
+
+    /**
+     * Insert a key-value pair (duplicate keys are kept).
+     */
+    void insert(const Key &key, const Value &value) {
+        Node root = read_node(hdr_.root_block);
+
+        // if root is full, put a new root above it and split
+        if (root.n == max_keys) {
+            Node new_root{}, sibling;
+            new_root.id = alloc_node();
+            new_root.children[0] = root.id;
+            hdr_.root_block = new_root.id;
+            split_child(new_root, 0, root, sibling);
+            insert_nonfull(new_root, key, value);
+        } else {
+            insert_nonfull(root, key, value);
+        }
+        dirty_ = true;
+    }
+
+    /**
+     * Look a key up.
+     * @return          The value of the first copy found, or nothing.
+     */
+    std::optional<Value> find(const Key &key) const {
+        uint64_t id = hdr_.root_block;
+        while (true) {
+            Node node = read_node(id);
+            std::size_t i = detail::rank<false>(node.keys, node.n, key, cmp_);
+            if (i < node.n && !cmp_(key, node.keys[i])) return node.values[i];
+            if (node.leaf()) return std::nullopt;
+            id = node.children[i];
+        }
+    }
+
+    /**
+     * Iterator over the entries in key order.
+     */
+    iterator begin() const { return iterator(this); }
+
+    /**
+     * Past-the-end iterator.
+     */
+    iterator end() const { return iterator(); }
+
+    /**
+     * Input iterator walking the tree in order with a stack of nodes. It
+     * reads the file as it advances, so the tree must not be modified while
+     * it is in use. Only comparison with end() is meaningful.
+     */
+    class iterator {
+    public:
+        using iterator_category = std::input_iterator_tag;
+        using value_type = BTree::value_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const value_type *;
+        using reference = const value_type &;
+
+        iterator() = default;
+
+        reference operator*() const { return current_; }
+        pointer operator->() const { return &current_; }
+
+        iterator &operator++() {
+            advance();
+            return *this;
+        }
+
+        void operator++(int) { advance(); }
+
+        bool operator==(const iterator &other) const { return at_end() == other.at_end(); }
+        bool operator!=(const iterator &other) const { return !(*this == other); }
+
+    private:
+        friend class BTree;
+
+        // node on the path to the current entry and its next entry to visit
+        struct Frame {
+            Node node;
+            std::size_t pos;
+        };
+
+        explicit iterator(const BTree *tree) : tree_(tree) {
+            descend_left(tree->hdr_.root_block);
+            advance();
+        }
+
+        bool at_end() const { return tree_ == nullptr; }
+
+        // helper to push the path down to the leftmost leaf of a subtree
+        void descend_left(uint64_t id) {
+            while (true) {
+                path_.push_back(Frame{tree_->read_node(id), 0});
+                const Node &node = path_.back().node;
+                if (node.leaf()) return;
+                id = node.children[0];
+            }
+        }
+
+        // helper to move to the next entry in key order
+        void advance() {
+            while (!path_.empty() && path_.back().pos == path_.back().node.n) path_.pop_back();
+            if (path_.empty()) {
+                tree_ = nullptr;
+                return;
+            }
+
+            Frame &frame = path_.back();
+            current_ = value_type(frame.node.keys[frame.pos], frame.node.values[frame.pos]);
+            frame.pos++;
+
+            // the entries right of this one come from the next child first
+            if (!frame.node.leaf()) descend_left(frame.node.children[frame.pos]);
+        }
+
+        const BTree *tree_ = nullptr;
+        std::vector<Frame> path_;
+        value_type current_{};
+    };
+
+private:
+    // byte offsets of the node fields in a block
+    static constexpr std::size_t children_offset = 16;
+    static constexpr std::size_t keys_offset = children_offset + 8 * max_children;
+    static constexpr std::size_t values_offset = keys_offset + sizeof(Key) * max_keys;
+    static_assert(values_offset + sizeof(Value) * max_keys <= BlockSize);
+
+    explicit BTree(Compare cmp) : cmp_(std::move(cmp)) {}
+
+    // helper to close without throwing (destructors, move assignment)
+    void close_quietly() noexcept {
+        if (fd_ < 0) return;
+        if (dirty_ && io_write_header(fd_, &hdr_) < 0) std::perror("io_write_header");
+        io_close(std::exchange(fd_, -1));
+    }
+
+    // helper to read and decode a node
+    Node read_node(uint64_t id) const {
+        std::array<uint8_t, BlockSize> buf;
+        if (io_read_block(fd_, id, buf.data(), BlockSize) < 0) detail::throw_errno("io_read_block");
+
+        Node node;
+        node.id = detail::load<uint64_t>(buf.data());
+        node.n = detail::load<uint64_t>(buf.data() + 8);
+        if (node.n > max_keys) throw std::runtime_error("corrupt node");
+        for (std::size_t i = 0; i < max_children; ++i) {
+            node.children[i] = detail::load<uint64_t>(buf.data() + children_offset + 8 * i);
+        }
+        for (std::size_t i = 0; i < node.n; ++i) {
+            node.keys[i] = detail::load<Key>(buf.data() + keys_offset + sizeof(Key) * i);
+            node.values[i] = detail::load<Value>(buf.data() + values_offset + sizeof(Value) * i);
+        }
+        return node;
+    }
+
+    // helper to encode and write a node to its block
+    void write_node(const Node &node) {
+        std::array<uint8_t, BlockSize> buf{};
+        detail::store<uint64_t>(buf.data(), node.id);
+        detail::store<uint64_t>(buf.data() + 8, node.n);
+        for (std::size_t i = 0; i < max_children; ++i) {
+            detail::store(buf.data() + children_offset + 8 * i, node.children[i]);
+        }
+        for (std::size_t i = 0; i < node.n; ++i) {
+            detail::store(buf.data() + keys_offset + sizeof(Key) * i, node.keys[i]);
+            detail::store(buf.data() + values_offset + sizeof(Value) * i, node.values[i]);
+        }
+        if (io_write_block(fd_, node.id, buf.data(), BlockSize) < 0) {
+            detail::throw_errno("io_write_block");
+        }
+    }
+
+    // helper to allocate a fresh block
+    uint64_t alloc_node() {
+        dirty_ = true;
+        return hdr_.next_free_block++;
+    }
+
+    // helper to split the full child at idx of parent, writing all three nodes
+    void split_child(Node &parent, std::size_t idx, Node &child, Node &sibling) {
+        sibling = Node{};
+        sibling.id = alloc_node();
+        sibling.n = degree - 1;
+
+        // the upper half moves to the sibling
+        for (std::size_t j = 0; j < degree - 1; ++j) {
+            sibling.keys[j] = child.keys[j + degree];
+            sibling.values[j] = child.values[j + degree];
+        }
+        if (!child.leaf()) {
+            for (std::size_t j = 0; j < degree; ++j) {
+                sibling.children[j] = child.children[j + degree];
+                child.children[j + degree] = 0;
+            }
+        }
+        child.n = degree - 1;
+
+        // the median moves up into the parent
+        for (std::size_t j = parent.n; j > idx; --j) {
+            parent.keys[j] = parent.keys[j - 1];
+            parent.values[j] = parent.values[j - 1];
+            parent.children[j + 1] = parent.children[j];
+        }
+        parent.keys[idx] = child.keys[degree - 1];
+        parent.values[idx] = child.values[degree - 1];
+        parent.children[idx + 1] = sibling.id;
+        parent.n++;
+
+        write_node(child);
+        write_node(sibling);
+        write_node(parent);
+    }
+
+    // helper to insert below a node that is not full
+    void insert_nonfull(Node node, const Key &key, const Value &value) {
+        while (true) {
+            // equal keys go right, after the copies already stored
+            std::size_t i = detail::rank<true>(node.keys, node.n, key, cmp_);
+
+            if (node.leaf()) {
+                for (std::size_t j = node.n; j > i; --j) {
+                    node.keys[j] = node.keys[j - 1];
+                    node.values[j] = node.values[j - 1];
+                }
+                node.keys[i] = key;
+                node.values[i] = value;
+                node.n++;
+                write_node(node);
+                return;
+            }
+
+            Node child = read_node(node.children[i]);
+            if (child.n == max_keys) {
+                Node sibling;
+                split_child(node, i, child, sibling);
+                if (!cmp_(key, node.keys[i])) child = std::move(sibling);
+            }
+            node = std::move(child);
+        }
+    }
+
+    int fd_ = -1;
+    BTHeader hdr_{};
+    bool dirty_ = false;
+    Compare cmp_;
+};
+
+} // namespace btree
+
+#endif /* BTREE_HPP */
@@ -0,0 +1,879 @@
+#ifndef BTREE_INTERNAL_H
+#define BTREE_INTERNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "btree.h"
+#include "bloom.h"
+#include "cache.h"
+#include "io.h"
+#include "constants.h"
+
+/**
+ * Internal definitions shared by the B-tree modules
+ */
+
+/**
+ * Block released by a copy-on-write commit
+ */
+typedef struct {
+    uint64_t block_id;  // released block
+    uint64_t gen;       // generation of the commit that released it
+} FreedBlock;
+
+/**
+ * Read counter of the hot-block table (see hot.c)
+ */
+typedef struct {
+    uint64_t block_id;
+    uint64_t count;
+} HotSlot;
+
+/**
+ * Piecewise-linear model of a frozen snapshot, mapping a key to the
+ * position of its first copy
+ */
+typedef struct {
+    uint64_t  count;    // pairs in the snapshot
+    uint64_t  nsegs;    // number of segments
+    uint64_t *keys;     // first key of each segment
+    double   *slopes;   // positions per key of each segment
+    uint64_t *starts;   // position of the first key of each segment
+} FrozenModel;
+
+/**
+ * Offset of the generation stamps of a node block (last 16 bytes)
+ */
+#define NODE_GEN_OFFSET (BLOCK_SIZE - 16)
+
+/**
+ * Message types of buffered mode
+ */
+#define MSG_INSERT  1   // add an entry (duplicates allowed)
+#define MSG_UPSERT  2   // replace the value of the key, or add it if missing
+
+/**
+ * Node of a B-tree, in host endianness. On disk the arrays are packed for the
+ * handle's degree: block_id, parent_id and n, then max_keys keys, max_keys
+ * values, max_keys + 1 children and, in counted mode, max_keys + 1 subtree
+ * sizes (7 * 8 + 4 * 104 = 456 bytes with COUNTED_DEGREE). Buffered mode
+ * stores the children first, so the node kind is known before the rest
+ * (see node_decode_buffered). Every layout ends with the two generations at
+ * NODE_GEN_OFFSET.
+ */
+typedef struct {
+    uint64_t block_id;               // block id this node is stored in
+    uint64_t parent_id;              // block id of parent (0 if root)
+    uint64_t n;                      // number of key/value pairs
+    uint64_t gen;                    // generation that last changed the node's entries
+    uint64_t max_gen;                // newest generation in the node's subtree
+    uint64_t keys[MAX_KEYS];         // keys array
+    uint64_t values[MAX_KEYS];       // values array
+    uint64_t children[MAX_CHILDREN]; // child pointers
+    uint64_t counts[MAX_CHILDREN];   // entries below each child (counted mode only)
+    // pending messages of an internal node, oldest first (buffered mode only)
+    uint64_t nmsgs;
+    uint64_t msg_keys[BUFFER_MESSAGES];
+    uint64_t msg_values[BUFFER_MESSAGES];
+    uint8_t  msg_types[BUFFER_MESSAGES];
+} BTNode;
+
+/**
+ * B-tree handle
+ */
+struct BTree {
+    int      fd;
+    BTHeader hdr;
+    char    *path;              // path of the index file (for sidecar files)
+    int      dirty;             // header changed and must be persisted on close
+    int      modified;          // tree contents changed through this handle
+    int      degree;            // minimum degree of the node format
+    int      max_keys;          // 2 * degree - 1
+    int      leaf_degree;       // minimum degree of leaves (differs in buffered mode)
+    int      leaf_max_keys;     // 2 * leaf_degree - 1
+
+    // negative lookup filter (NULL if disabled or stale)
+    Bloom   *bloom;
+    int      bloom_stats_dirty; // lookup counters changed since open
+
+    // private block cache of a direct I/O handle (NULL otherwise)
+    BlockCache *cache;
+
+    // model of a frozen snapshot (see frozen.c), NULL otherwise
+    FrozenModel *model;
+
+    // secondary value index (see vindex.c), NULL if disabled
+    BTree   *vindex;
+
+    // multi-process locking state (see lock.c)
+    const void *hdr_map;        // shared mapping of the header block, NULL if unlocked
+    int         writer;         // this handle holds the writer lock
+    int         op_depth;       // nesting of the operation in progress
+    int         op_write;       // the operation in progress may change the tree
+    int         unpublished;    // changes not yet published in the header
+
+    // hot-block tracking and background warm-up (see hot.c)
+    HotSlot    *hot;            // read counters, NULL if not tracked
+    pthread_t   warm_thread;
+    int         warming;        // the warm-up thread has been started
+    int         warm_stop;      // asks the warm-up thread to stop
+
+    // copy-on-write state (see cow.c)
+    int         pinned;         // a snapshot pin is held by this handle
+    uint64_t    pinned_gen;     // generation of the pinned snapshot
+    int         free_loaded;    // free list was taken over from the file
+    uint64_t   *free_ids;       // blocks that can be reused right away
+    size_t      free_count;
+    size_t      free_cap;
+    FreedBlock *retired;        // blocks older snapshots may still read
+    size_t      retired_count;
+    size_t      retired_cap;
+
+    // sharded index state (see shard.c), NULL for a single tree
+    BTree     **shards;         // one handle per shard file
+
+    // append fast path state (see append.c)
+    BTNode     *right_path;     // nodes from the root to the rightmost leaf
+    int         right_depth;    // number of cached nodes, 0 if stale
+    int         max_known;      // max_key has been read
+    uint64_t    max_key;        // largest key of the tree (0 if empty)
+};
+
+/**
+ * Node helpers (btree.c)
+ */
+
+/**
+ * Read a raw block, through the block cache of direct I/O handles
+ * @param t         The BTree handle
+ * @param id        Block id
+ * @param buf       Aligned buffer of BLOCK_SIZE bytes
+ */
+void read_block(BTree *t, uint64_t id, void *buf);
+
+/**
+ * Write a raw block, keeping the block cache of direct I/O handles current
+ * @param t         The BTree handle
+ * @param id        Block id
+ * @param buf       Aligned buffer of BLOCK_SIZE bytes
+ */
+void write_block(BTree *t, uint64_t id, const void *buf);
+
+/**
+ * Read a node and convert it to host endianness
+ * @param t         The BTree handle
+ * @param id        Block id of the node
+ * @param node      Node to read into
+ */
+void read_node(BTree *t, uint64_t id, BTNode *node);
+
+/**
+ * Convert a node to big-endian and write it
+ * @param t         The BTree handle
+ * @param id        Block id of the node
+ * @param node      Node to write
+ */
+void write_node(BTree *t, uint64_t id, BTNode *node);
+
+/**
+ * Record that a node's subtree changed in the current generation, writing
+ * the node only if it was not stamped yet
+ * @param t         The BTree handle (write already begun)
+ * @param node      Node on the path to a node that was written
+ */
+void touch_node(BTree *t, BTNode *node);
+
+/**
+ * Read and decode several nodes in one batch
+ * @param t         The BTree handle
+ * @param ids       Block ids of the nodes
+ * @param count     Number of nodes
+ * @param nodes     Nodes to read into
+ */
+void read_nodes(BTree *t, const uint64_t *ids, int count, BTNode *nodes);
+
+/**
+ * Convert several nodes to big-endian and write them in one batch
+ * @param t         The BTree handle
+ * @param nodes     Nodes to write, each to its own block_id
+ * @param count     Number of nodes
+ */
+void write_nodes(BTree *t, BTNode **nodes, int count);
+
+/**
+ * Set every child's parent_id to the node (batched)
+ * @param t         The BTree handle
+ * @param node      Internal node whose children are rewritten
+ */
+void adopt_children(BTree *t, const BTNode *node);
+
+/**
+ * Check whether a node has no room for another key
+ * @param t         The BTree handle
+ * @param node      Node to check
+ * @return          1 if full, 0 otherwise
+ */
+int node_full(const BTree *t, const BTNode *node);
+
+/**
+ * Mark an in-place tree as being modified, bumping the generation once
+ * @param t         The BTree handle
+ */
+void begin_write(BTree *t);
+
+/**
+ * Insert a key-value pair with top-down splits, ignoring message buffers
+ * @param t         The BTree handle
+ * @param key       Key to insert
+ * @param value     Value to insert
+ */
+void tree_insert(BTree *t, uint64_t key, uint64_t value);
+
+/**
+ * Replace the value of the first entry search finds for a key, in place
+ * @param t         The BTree handle
+ * @param key       Key to update
+ * @param value     New value
+ * @return          SUCCESS, or ERROR_KEY_NOT_FOUND if the key is absent
+ */
+int tree_update(BTree *t, uint64_t key, uint64_t value);
+
+/**
+ * Allocate a fresh block
+ * @param t         The BTree handle
+ * @return          Block id of the new block
+ */
+uint64_t alloc_node(BTree *t);
+
+/**
+ * Insert a key-value pair into a leaf that has room for it (in memory)
+ * @param node      Leaf node
+ * @param key       Key to insert
+ * @param value     Value to insert
+ */
+void leaf_insert(BTNode *node, uint64_t key, uint64_t value);
+
+/**
+ * Move the upper half of a full child into a sibling and lift the median
+ * into the parent (in memory, nothing is written)
+ * @param t         The BTree handle
+ * @param parent    Parent node
+ * @param idx       Index of the child within the parent
+ * @param child     Full child node
+ * @param sibling   Node to fill with the upper half
+ * @param sib_id    Block id of the sibling
+ */
+void split_node(BTree *t, BTNode *parent, int idx, BTNode *child, BTNode *sibling, uint64_t sib_id);
+
+/**
+ * Count the entries of a subtree from its root node (counted mode)
+ * @param node      Root node of the subtree
+ * @return          Number of key/value pairs in the subtree
+ */
+uint64_t node_total(const BTNode *node);
+
+/**
+ * Count the entries of a tree below a key (counted mode, operation begun)
+ * @param t         The BTree handle
+ * @param key       Bound
+ * @param inclusive 1 to count the copies of the key as well
+ * @return          Number of entries
+ */
+uint64_t tree_count_below(BTree *t, uint64_t key, int inclusive);
+
+/**
+ * Find the entry at a position of a tree (counted mode, operation begun)
+ * @param t         The BTree handle
+ * @param k         0-based position
+ * @param key       Pointer to store the key
+ * @param value     Pointer to store the value (may be NULL)
+ * @return          SUCCESS or ERROR_KEY_NOT_FOUND
+ */
+int tree_select(BTree *t, uint64_t k, uint64_t *key, uint64_t *value);
+
+/**
+ * Callback invoked for each key-value pair of a scan
+ * @param ctx       Caller context
+ * @param key       Key of the pair
+ * @param value     Value of the pair
+ */
+typedef void (*ScanFn)(void *ctx, uint64_t key, uint64_t value);
+
+/**
+ * Visit every copy of a key in tree order, ignoring message buffers
+ * @param t         The BTree handle
+ * @param key       Key to look for
+ * @param fn        Callback invoked for each copy
+ * @param ctx       Context passed to the callback
+ */
+void tree_scan_key(BTree *t, uint64_t key, ScanFn fn, void *ctx);
+
+/**
+ * Growable list of keys, filled by scans (start from a zeroed list and free
+ * keys when done)
+ */
+typedef struct {
+    uint64_t *keys;
+    size_t    count;
+    size_t    cap;
+} KeyList;
+
+/**
+ * Append a key to a list, growing it as needed
+ * @param list      The list
+ * @param key       Key to append
+ */
+void key_list_add(KeyList *list, uint64_t key);
+
+/**
+ * qsort comparator for 64-bit keys (or block ids) in increasing order
+ * @param a         Pointer to the first key
+ * @param b         Pointer to the second key
+ * @return          Negative, zero or positive like memcmp
+ */
+int compare_keys(const void *a, const void *b);
+
+/**
+ * Callback invoked for each key-value pair read from a CSV file
+ * @param ctx       Caller context
+ * @param key       Key of the pair
+ * @param value     Value of the pair
+ * @return          SUCCESS if the pair was accepted, non-zero otherwise
+ */
+typedef int (*PairFn)(void *ctx, uint64_t key, uint64_t value);
+
+/**
+ * Parse a CSV file of key,value lines, skipping blank and # lines
+ * @param csv_file  Path to the CSV file
+ * @param fn        Callback invoked for each pair
+ * @param ctx       Context passed to the callback
+ * @return          Number of pairs accepted by the callback, or -1 if the
+ *                  file cannot be opened
+ */
+int csv_for_each(const char *csv_file, PairFn fn, void *ctx);
+
+/**
+ * Rebuild the Bloom filter from the contents of the tree
+ * @param t         The BTree handle
+ */
+void bloom_rebuild(BTree *t);
+
+/**
+ * Copy-on-write functions (cow.c)
+ */
+
+/**
+ * Pin the snapshot described by the handle's header, so that writers in
+ * other processes keep its blocks until the handle is closed. If a commit
+ * got in before the pin took hold, the handle moves on to the newest header.
+ * @param t         The BTree handle
+ * @return          1 if the handle moved to a newer header, 0 otherwise
+ */
+int cow_pin_snapshot(BTree *t);
+
+/**
+ * Insert a key-value pair by copying the root-to-leaf path to new blocks
+ * and publishing the new root in the header
+ * @param t         The BTree handle
+ * @param key       Key to insert
+ * @param value     Value to insert
+ * @param update    1 to replace the value of the first copy of the key
+ *                  instead (the key must exist)
+ */
+void cow_insert(BTree *t, uint64_t key, uint64_t value, int update);
+
+/**
+ * Take a reusable block from the free list
+ * @param t         The BTree handle
+ * @return          Block id, or 0 if no block can be reused yet
+ */
+uint64_t cow_alloc(BTree *t);
+
+/**
+ * Persist the free list and header, and release the free list memory
+ * @param t         The BTree handle
+ */
+void cow_close(BTree *t);
+
+/**
+ * Multi-process locking (lock.c)
+ */
+
+/**
+ * Map the header of a freshly opened handle, enabling locking
+ * @param t         The BTree handle
+ */
+void lock_open(BTree *t);
+
+/**
+ * Unmap the header (the locks go away with the file descriptor)
+ * @param t         The BTree handle
+ */
+void lock_close(BTree *t);
+
+/**
+ * Read the header as the writer last wrote it. Copy-on-write readers hold no
+ * lock against the writer, so the header is read until two reads agree.
+ * @param t         The BTree handle
+ * @param hdr       Output header
+ */
+void lock_read_header(BTree *t, BTHeader *hdr);
+
+/**
+ * Make the handle the writer of the index until it is closed, waiting for
+ * the writer of another handle to close first
+ * @param t         The BTree handle
+ */
+void lock_write(BTree *t);
+
+/**
+ * Start an operation: take the tree lock and pick up the changes other
+ * processes published. Operations nest; only the outermost one locks.
+ * @param t         The BTree handle
+ * @param write     1 if the operation may change the tree
+ */
+void lock_enter(BTree *t, int write);
+
+/**
+ * End an operation started by lock_enter, publishing its changes
+ * @param t         The BTree handle
+ */
+void lock_leave(BTree *t);
+
+/**
+ * Find the newest generation that no open writer session adds to anymore,
+ * the one a later incremental export can start from (call inside an
+ * operation, so no session starts meanwhile)
+ * @param t         The BTree handle
+ * @return          The current generation, or the one before it while a
+ *                  writer session is open
+ */
+uint64_t lock_watermark(BTree *t);
+
+/**
+ * Write the header for other processes to pick up
+ * @param t         The BTree handle
+ * @return          0 on success, -1 on error
+ */
+int lock_publish(BTree *t);
+
+/**
+ * Hot blocks and warm-up (hot.c)
+ */
+
+/**
+ * Start counting the reads of a handle's blocks
+ * @param t         The BTree handle
+ */
+void hot_open(BTree *t);
+
+/**
+ * Count a read of a block
+ * @param t         The BTree handle
+ * @param id        Block id
+ */
+void hot_note(BTree *t, uint64_t id);
+
+/**
+ * Record the most read blocks in the manifest <index>.hot, merged with the
+ * counts already recorded there, and free the counters
+ * @param t         The BTree handle
+ */
+void hot_close(BTree *t);
+
+/**
+ * Start a thread that reads the top levels of the tree and the blocks of the
+ * manifest, in block order, into the block cache (or the page cache)
+ * @param t         The BTree handle
+ */
+void warm_start(BTree *t);
+
+/**
+ * Stop the warm-up thread, if it is still running, and wait for it
+ * @param t         The BTree handle
+ */
+void warm_stop(BTree *t);
+
+/**
+ * Find the children of a raw node block without decoding the rest
+ * @param buf       Raw block of BLOCK_SIZE bytes
+ * @param flags     Index mode flags
+ * @param max_keys  Keys per internal node
+ * @param children  Array of MAX_CHILDREN entries to store the child ids
+ * @return          Number of children, 0 for a leaf or an unreadable block
+ */
+int block_children(const void *buf, uint64_t flags, int max_keys, uint64_t *children);
+
+/**
+ * Append fast path (append.c)
+ */
+
+/**
+ * Append a key at or above the largest key along the cached right edge
+ * @param t         The BTree handle (in-place mode, write already begun)
+ * @param key       Key to insert
+ * @param value     Value to insert
+ * @return          1 if the pair was inserted, 0 if the caller must insert it
+ */
+int append_insert(BTree *t, uint64_t key, uint64_t value);
+
+/**
+ * Drop the cached right edge and the largest key, after a change that may
+ * have moved either
+ * @param t         The BTree handle
+ */
+void append_forget(BTree *t);
+
+/**
+ * Buffered mode functions (buffer.c)
+ */
+
+/**
+ * Add a message to the root buffer, flushing buffers down as they fill
+ * @param t         The BTree handle (write already begun)
+ * @param type      MSG_INSERT or MSG_UPSERT
+ * @param key       Key of the message
+ * @param value     Value of the message
+ */
+void buffer_put(BTree *t, int type, uint64_t key, uint64_t value);
+
+/**
+ * Look a key up, taking pending messages into account
+ * @param t         The BTree handle
+ * @param key       Key to search for
+ * @param value     Pointer to store the value (may be NULL)
+ * @return          SUCCESS or ERROR_KEY_NOT_FOUND
+ */
+int buffer_search(BTree *t, uint64_t key, uint64_t *value);
+
+/**
+ * Read-only view of a buffered tree: pairs fed in key order come out with
+ * the pending messages of the nodes fed so far applied
+ */
+typedef struct BufferView BufferView;
+
+/**
+ * Start a view
+ * @param low       Smallest key to report
+ * @param high      Largest key to report
+ * @param fn        Callback invoked for each resolved pair, in key order
+ * @param ctx       Context passed to the callback
+ * @return          The view
+ */
+BufferView* buffer_view_new(uint64_t low, uint64_t high, ScanFn fn, void *ctx);
+
+/**
+ * Add the messages of a node, before any pair of its subtree
+ * @param v         The view
+ * @param node      Node entered by the scan
+ * @param depth     Depth of the node (0 for the root)
+ */
+void buffer_view_node(BufferView *v, const BTNode *node, int depth);
+
+/**
+ * Add a stored pair; pairs must come in key order
+ * @param v         The view
+ * @param key       Key of the pair
+ * @param value     Value of the pair
+ * @param depth     Depth of its node
+ * @param visible   0 if the pair is only needed to resolve messages
+ */
+void buffer_view_pair(BufferView *v, uint64_t key, uint64_t value, int depth, int visible);
+
+/**
+ * Report everything still held back, at the end of a scan
+ * @param v         The view
+ */
+void buffer_view_finish(BufferView *v);
+
+/**
+ * Free a view
+ * @param v         The view (may be NULL)
+ */
+void buffer_view_free(BufferView *v);
+
+/**
+ * Visit the pairs of nodes written at min_gen or later in key order, with the
+ * pending messages of those nodes applied, without changing the tree
+ * @param t         The BTree handle
+ * @param min_gen   Oldest generation to report (0 for every pair)
+ * @param fn        Callback invoked for each pair
+ * @param ctx       Context passed to the callback
+ */
+void buffer_scan(BTree *t, uint64_t min_gen, ScanFn fn, void *ctx);
+
+/**
+ * Visit every copy of a key, with its pending messages applied
+ * @param t         The BTree handle
+ * @param key       Key to look for
+ * @param fn        Callback invoked for each copy
+ * @param ctx       Context passed to the callback
+ */
+void buffer_scan_key(BTree *t, uint64_t key, ScanFn fn, void *ctx);
+
+/**
+ * Batch merge functions (batch.c)
+ */
+
+/**
+ * Merge a batch of pairs into the tree in a single walk
+ * @param t         The BTree handle (in-place mode, write already begun)
+ * @param keys      Keys to insert, in any order
+ * @param values    Values to insert
+ * @param count     Number of pairs
+ */
+void batch_merge(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count);
+
+/**
+ * Hash engine functions (hash.c)
+ */
+
+/**
+ * Lay out an empty directory and its first bucket
+ * @param t         Handle of a new hash index, before its header is written
+ */
+void hash_create(BTree *t);
+
+/**
+ * Insert a key-value pair, replacing the value if the key is present
+ * @param t         The BTree handle (write already begun)
+ * @param key       Key to insert
+ * @param value     Value to store
+ */
+void hash_put(BTree *t, uint64_t key, uint64_t value);
+
+/**
+ * Look a key up
+ * @param t         The BTree handle
+ * @param key       Key to search for
+ * @param value     Pointer to store the value (may be NULL)
+ * @return          SUCCESS or ERROR_KEY_NOT_FOUND
+ */
+int hash_search(BTree *t, uint64_t key, uint64_t *value);
+
+/**
+ * Visit every pair once, in hash order
+ * @param t         The BTree handle
+ * @param fn        Callback invoked for each pair
+ * @param ctx       Context passed to the callback
+ */
+void hash_scan(BTree *t, ScanFn fn, void *ctx);
+
+/**
+ * Print the directory and every bucket
+ * @param t         The BTree handle
+ */
+void hash_print(BTree *t);
+
+/**
+ * Streaming merge functions (merge.c)
+ */
+
+/**
+ * Merge two indexes in key order into a new index built bottom-up
+ * @param a         Handle of the first index
+ * @param b         Handle of the second index
+ * @param path      Path of the index file to create
+ * @param policy    BT_MERGE_BOTH, BT_MERGE_FIRST or BT_MERGE_SECOND
+ * @return          SUCCESS, or ERROR_FILE_EXISTS if the path is taken
+ */
+int merge_write(BTree *a, BTree *b, const char *path, int policy);
+
+/**
+ * Secondary value index functions (vindex.c)
+ */
+
+/**
+ * Create an empty secondary next to a new index
+ * @param t         Handle of the primary index
+ */
+void vindex_create(BTree *t);
+
+/**
+ * Open the secondary of an index, rebuilding it if the file is missing
+ * @param t         Handle of the primary index
+ */
+void vindex_open(BTree *t);
+
+/**
+ * Close the secondary (nothing happens if there is none)
+ * @param t         Handle of the primary index
+ */
+void vindex_close(BTree *t);
+
+/**
+ * Record a pair in the secondary, before it is written to the primary
+ * @param t         Handle of the primary index
+ * @param key       Key of the pair
+ * @param value     Value of the pair
+ */
+void vindex_add(BTree *t, uint64_t key, uint64_t value);
+
+/**
+ * Record a batch of pairs in the secondary with one batch merge
+ * @param t         Handle of the primary index
+ * @param keys      Keys of the pairs
+ * @param values    Values of the pairs
+ * @param count     Number of pairs
+ */
+void vindex_add_batch(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count);
+
+/**
+ * Replace the secondary with one built from the pairs of the primary
+ * @param t         Handle of the primary index
+ */
+void vindex_build(BTree *t);
+
+/**
+ * Find the keys whose pair in the primary has a value
+ * @param t         Handle of the primary index
+ * @param value     Value to look for
+ * @param keys      Pointer to store a malloc'd array of distinct keys, in
+ *                  increasing order (freed by the caller)
+ * @param count     Pointer to store the number of keys
+ * @return          SUCCESS, or ERROR_KEY_NOT_FOUND if no key has the value
+ */
+int vindex_search(BTree *t, uint64_t value, uint64_t **keys, size_t *count);
+
+/**
+ * Frozen snapshot functions (frozen.c)
+ */
+
+/**
+ * Write the pairs of an index to a new read-only snapshot file
+ * @param src       Handle of the index to freeze
+ * @param path      Path of the snapshot file to create
+ * @return          SUCCESS, or ERROR_FILE_EXISTS if the path is taken
+ */
+int frozen_write(BTree *src, const char *path);
+
+/**
+ * Load the model of a snapshot into memory
+ * @param t         Handle of the snapshot, with its header read
+ */
+void frozen_open(BTree *t);
+
+/**
+ * Free the model of a snapshot
+ * @param t         Handle of the snapshot (nothing happens for other handles)
+ */
+void frozen_close(BTree *t);
+
+/**
+ * Look a key up through the model
+ * @param t         Handle of the snapshot
+ * @param key       Key to search for
+ * @param value     Pointer to store the value (may be NULL)
+ * @return          SUCCESS or ERROR_KEY_NOT_FOUND
+ */
+int frozen_search(BTree *t, uint64_t key, uint64_t *value);
+
+/**
+ * Read the pair at a position, for walking a snapshot in key order
+ * @param t         Handle of the snapshot
+ * @param pos       0-based position, one more than the previous call
+ * @param page      Buffer of BLOCK_SIZE bytes kept between calls
+ * @param key       Pointer to store the key
+ * @param value     Pointer to store the value
+ * @return          SUCCESS, or ERROR_KEY_NOT_FOUND past the last pair
+ */
+int frozen_next(BTree *t, uint64_t pos, uint8_t *page, uint64_t *key, uint64_t *value);
+
+/**
+ * Visit every pair in key order
+ * @param t         Handle of the snapshot
+ * @param fn        Callback invoked for each pair
+ * @param ctx       Context passed to the callback
+ */
+void frozen_scan(BTree *t, ScanFn fn, void *ctx);
+
+/**
+ * Print the model summary and every page
+ * @param t         Handle of the snapshot
+ */
+void frozen_print(BTree *t);
+
+/**
+ * Sharded index functions (shard.c)
+ */
+
+/**
+ * Create the shard files of a new manifest
+ * @param t         Handle of the manifest, with flags and shard_count set
+ */
+void shard_create(BTree *t);
+
+/**
+ * Open the shard files named by a manifest
+ * @param t         Handle of the manifest
+ */
+void shard_open(BTree *t);
+
+/**
+ * Close every shard and free the shard table
+ * @param t         Handle of the manifest
+ */
+void shard_close(BTree *t);
+
+/**
+ * Find the shard a key belongs to
+ * @param t         Handle of the manifest
+ * @param key       Key to route
+ * @return          Handle of the shard
+ */
+BTree* shard_route(BTree *t, uint64_t key);
+
+/**
+ * Load a CSV file, building every shard in its own thread
+ * @param t         Handle of the manifest
+ * @param csv_file  Path to the CSV file
+ * @return          SUCCESS on success, -1 if the file cannot be read
+ */
+int shard_load(BTree *t, const char *csv_file);
+
+/**
+ * Split a batch by shard and merge each part into its shard
+ * @param t         Handle of the manifest
+ * @param keys      Keys to insert
+ * @param values    Values to insert
+ * @param count     Number of pairs
+ * @return          SUCCESS
+ */
+int shard_insert_batch(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count);
+
+/**
+ * Start a read operation on every shard, so a series of counts sees one
+ * version of each
+ * @param t         Handle of the manifest
+ */
+void shard_enter_all(BTree *t);
+
+/**
+ * End the operations started by shard_enter_all
+ * @param t         Handle of the manifest
+ */
+void shard_leave_all(BTree *t);
+
+/**
+ * Count the entries of all shards below a key (counted mode, inside
+ * shard_enter_all)
+ * @param t         Handle of the manifest
+ * @param key       Bound
+ * @param inclusive 1 to count the copies of the key as well
+ * @return          Number of entries
+ */
+uint64_t shard_count_below(BTree *t, uint64_t key, int inclusive);
+
+/**
+ * Find the entry at a position of the merged key order
+ * @param t         Handle of the manifest
+ * @param k         0-based position
+ * @param key       Pointer to store the key
+ * @param value     Pointer to store the value (may be NULL)
+ * @return          Status code as for bt_select
+ */
+int shard_select(BTree *t, uint64_t k, uint64_t *key, uint64_t *value);
+
+#endif /* BTREE_INTERNAL_H */
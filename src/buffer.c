@@ -0,0 +1,513 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Buffered (B-epsilon) write path
+ *
+ * Internal nodes keep only a few keys and give most of their block to a
+ * buffer of pending messages. A write only adds a message to the root
+ * buffer; when a buffer fills, the messages for its busiest child are
+ * pushed one level down in a single step, so every node write carries many
+ * updates. Leaves keep the normal format and apply the messages they get.
+ *
+ * Messages for one key always follow the same path and keep their order,
+ * so deeper messages are older. An upsert is resolved against the first
+ * copy of its key on that path: it is applied as soon as it reaches a node
+ * holding the key, and an entry that moves up into a node absorbs the
+ * upserts waiting there. A buffer therefore never holds an upsert for a key
+ * stored in its own node.
+ *
+ * Scans read the tree through a view instead of flushing it, so they never
+ * write. The view collects the messages of every node the scan enters and
+ * holds back the copies of a key until a larger key shows up. It then
+ * applies the key's messages to them the way a flush would, oldest first.
+ */
+
+// pending message seen by a view
+typedef struct {
+    uint64_t key;
+    uint64_t value;
+    int      type;
+    int      depth;     // deeper messages are older
+    int      seq;       // position in its buffer, older first
+} Pending;
+
+// copy of a key while the messages for it are resolved
+typedef struct {
+    uint64_t value;
+    int      depth;     // depth of its node, NEW_COPY for a pending insert
+    int      visible;   // reported by the scan, or changed by a message
+} Copy;
+
+// depth of the copies added by pending inserts, below every stored copy
+#define NEW_COPY INT_MAX
+
+struct BufferView {
+    ScanFn    fn;
+    void     *ctx;
+    uint64_t  low;          // keys outside [low, high] are ignored
+    uint64_t  high;
+
+    // messages of the nodes entered so far, as a heap ordered by key, oldest
+    // first
+    Pending  *heap;
+    size_t    count;
+    size_t    cap;
+
+    // copies of the key being collected
+    int       open;
+    uint64_t  key;
+    Copy     *copies;
+    size_t    ncopies;
+    size_t    copies_cap;
+};
+
+// helper to find the child a key is routed to (equal keys go right)
+static int route(const BTNode *node, uint64_t key) {
+    int i = node->n - 1;
+    while (i >= 0 && key < node->keys[i]) i--;
+    return i + 1;
+}
+
+// helper to find an entry with the key in a node (-1 if none)
+static int find_key(const BTNode *node, uint64_t key) {
+    for (int i = 0; i < node->n; i++) {
+        if (node->keys[i] == key) return i;
+    }
+    return -1;
+}
+
+// helper to remove the upserts of a key from a buffer, keeping the newest value
+static int absorb_upserts(BTNode *node, uint64_t key, uint64_t *value) {
+    int found = 0;
+    int kept = 0;
+    for (int j = 0; j < node->nmsgs; j++) {
+        if (node->msg_types[j] == MSG_UPSERT && node->msg_keys[j] == key) {
+            *value = node->msg_values[j];
+            found = 1;
+            continue;
+        }
+        node->msg_keys[kept] = node->msg_keys[j];
+        node->msg_values[kept] = node->msg_values[j];
+        node->msg_types[kept] = node->msg_types[j];
+        kept++;
+    }
+    node->nmsgs = kept;
+    return found;
+}
+
+// helper to let a key that just moved up into a parent absorb the upserts
+// waiting for it (the sibling's are older than the parent's)
+static void lift_median(BTNode *parent, int idx, BTNode *sibling) {
+    uint64_t value;
+    if (absorb_upserts(sibling, parent->keys[idx], &value)) parent->values[idx] = value;
+    if (absorb_upserts(parent, parent->keys[idx], &value)) parent->values[idx] = value;
+}
+
+// helper to append a message to a buffer with room for it
+static void push_message(BTNode *node, int type, uint64_t key, uint64_t value) {
+    node->msg_keys[node->nmsgs] = key;
+    node->msg_values[node->nmsgs] = value;
+    node->msg_types[node->nmsgs] = type;
+    node->nmsgs++;
+}
+
+// helper to put a new internal root above a full root (written, returned in root)
+static void grow_root(BTree *t, BTNode *root) {
+    BTNode new_root, sibling;
+    memset(&new_root, 0, sizeof(new_root));
+    new_root.block_id = alloc_node(t);
+    new_root.children[0] = root->block_id;
+    root->parent_id = new_root.block_id;
+
+    split_node(t, &new_root, 0, root, &sibling, alloc_node(t));
+    lift_median(&new_root, 0, &sibling);
+    adopt_children(t, &sibling);
+
+    BTNode *dirty[3] = { root, &sibling, &new_root };
+    write_nodes(t, dirty, 3);
+    t->hdr.root_block = new_root.block_id;
+    *root = new_root;
+}
+
+// helper to apply all of a node's messages for child c to that leaf,
+// splitting it once if they do not fit
+static void flush_to_leaf(BTree *t, BTNode *node, int c, BTNode *leaf) {
+    uint64_t keys[MAX_KEYS + BUFFER_MESSAGES];
+    uint64_t values[MAX_KEYS + BUFFER_MESSAGES];
+    int count = leaf->n;
+    memcpy(keys, leaf->keys, count * sizeof(uint64_t));
+    memcpy(values, leaf->values, count * sizeof(uint64_t));
+
+    // apply the messages in order, keeping the others in the parent
+    int kept = 0;
+    for (int j = 0; j < node->nmsgs; j++) {
+        uint64_t key = node->msg_keys[j];
+        if (route(node, key) != c) {
+            node->msg_keys[kept] = key;
+            node->msg_values[kept] = node->msg_values[j];
+            node->msg_types[kept] = node->msg_types[j];
+            kept++;
+            continue;
+        }
+
+        // an upsert replaces the first copy of the key
+        int pos = 0;
+        while (pos < count && keys[pos] < key) pos++;
+        if (node->msg_types[j] == MSG_UPSERT && pos < count && keys[pos] == key) {
+            values[pos] = node->msg_values[j];
+            continue;
+        }
+
+        // anything else is inserted after the existing copies
+        while (pos < count && keys[pos] == key) pos++;
+        memmove(&keys[pos + 1], &keys[pos], (count - pos) * sizeof(uint64_t));
+        memmove(&values[pos + 1], &values[pos], (count - pos) * sizeof(uint64_t));
+        keys[pos] = key;
+        values[pos] = node->msg_values[j];
+        count++;
+    }
+    node->nmsgs = kept;
+
+    // keys up to the middle stay, the middle one moves up, the rest go right
+    int left = count <= t->leaf_max_keys ? count : (count - 1) / 2;
+    memset(leaf->keys, 0, sizeof(leaf->keys));
+    memset(leaf->values, 0, sizeof(leaf->values));
+    memcpy(leaf->keys, keys, left * sizeof(uint64_t));
+    memcpy(leaf->values, values, left * sizeof(uint64_t));
+    leaf->n = left;
+    if (left == count) {
+        write_node(t, leaf->block_id, leaf);
+        return;
+    }
+
+    BTNode sibling;
+    memset(&sibling, 0, sizeof(sibling));
+    sibling.block_id = alloc_node(t);
+    sibling.parent_id = node->block_id;
+    sibling.n = count - left - 1;
+    memcpy(sibling.keys, &keys[left + 1], sibling.n * sizeof(uint64_t));
+    memcpy(sibling.values, &values[left + 1], sibling.n * sizeof(uint64_t));
+
+    // every message for this range was applied, so none waits for the middle key
+    for (int j = node->n; j > c; j--) {
+        node->keys[j] = node->keys[j-1];
+        node->values[j] = node->values[j-1];
+        node->children[j+1] = node->children[j];
+    }
+    node->keys[c] = keys[left];
+    node->values[c] = values[left];
+    node->children[c+1] = sibling.block_id;
+    node->n++;
+
+    BTNode *dirty[2] = { leaf, &sibling };
+    write_nodes(t, dirty, 2);
+}
+
+// helper to move messages from a node's buffer into its busiest child; the
+// node must have room for one more key and is only changed in memory
+static void flush_child(BTree *t, BTNode *node) {
+    // pick the child with the most pending messages
+    int pending[MAX_CHILDREN] = {0};
+    for (int j = 0; j < node->nmsgs; j++) pending[route(node, node->msg_keys[j])]++;
+    int c = 0;
+    for (int i = 1; i <= node->n; i++) {
+        if (pending[i] > pending[c]) c = i;
+    }
+
+    BTNode child, sibling;
+    read_node(t, node->children[c], &child);
+
+    // leaves take the whole group at once
+    if (child.children[0] == 0) {
+        flush_to_leaf(t, node, c, &child);
+        return;
+    }
+
+    // a full child is split first, so it can take a key from its own flush
+    if (child.n == t->max_keys) {
+        split_node(t, node, c, &child, &sibling, alloc_node(t));
+        lift_median(node, c, &sibling);
+        adopt_children(t, &sibling);
+
+        // continue with the half that gets more of the messages
+        int left = 0, right = 0;
+        for (int j = 0; j < node->nmsgs; j++) {
+            int r = route(node, node->msg_keys[j]);
+            if (r == c) left++;
+            else if (r == c + 1) right++;
+        }
+        if (right > left) {
+            write_node(t, child.block_id, &child);
+            child = sibling;
+            c++;
+        } else {
+            write_node(t, sibling.block_id, &sibling);
+        }
+    }
+
+    // make room in the child's buffer
+    if (child.nmsgs == BUFFER_MESSAGES) flush_child(t, &child);
+
+    // move the oldest messages of the group, as many as fit
+    int kept = 0;
+    for (int j = 0; j < node->nmsgs; j++) {
+        uint64_t key = node->msg_keys[j];
+        if (route(node, key) == c && child.nmsgs < BUFFER_MESSAGES) {
+            int found = node->msg_types[j] == MSG_UPSERT ? find_key(&child, key) : -1;
+            if (found >= 0) child.values[found] = node->msg_values[j];
+            else push_message(&child, node->msg_types[j], key, node->msg_values[j]);
+            continue;
+        }
+        node->msg_keys[kept] = key;
+        node->msg_values[kept] = node->msg_values[j];
+        node->msg_types[kept] = node->msg_types[j];
+        kept++;
+    }
+    node->nmsgs = kept;
+    write_node(t, child.block_id, &child);
+}
+
+void buffer_put(BTree *t, int type, uint64_t key, uint64_t value) {
+    BTNode root;
+    read_node(t, t->hdr.root_block, &root);
+
+    if (root.children[0] == 0) {
+        // a tree that is a single leaf is updated directly
+        int found = type == MSG_UPSERT ? find_key(&root, key) : -1;
+        if (found >= 0 || !node_full(t, &root)) {
+            if (found >= 0) root.values[found] = value;
+            else leaf_insert(&root, key, value);
+            write_node(t, root.block_id, &root);
+            return;
+        }
+        grow_root(t, &root);
+    } else if (root.nmsgs == BUFFER_MESSAGES && root.n == t->max_keys) {
+        // flushing may add a key to the root, so it must have room for one
+        grow_root(t, &root);
+    }
+
+    // an upsert of a key stored in the root is applied right away
+    int found = type == MSG_UPSERT ? find_key(&root, key) : -1;
+    if (found >= 0) {
+        root.values[found] = value;
+    } else {
+        if (root.nmsgs == BUFFER_MESSAGES) flush_child(t, &root);
+        push_message(&root, type, key, value);
+    }
+    write_node(t, root.block_id, &root);
+}
+
+int buffer_search(BTree *t, uint64_t key, uint64_t *value) {
+    BTNode node;
+    uint64_t current_node_id = t->hdr.root_block;
+    int have_insert = 0;
+    uint64_t insert_value = 0;
+
+    while (1) {
+        read_node(t, current_node_id, &node);
+
+        // the newest pending upsert decides the value
+        for (int j = node.nmsgs - 1; j >= 0; j--) {
+            if (node.msg_keys[j] != key) continue;
+            if (node.msg_types[j] == MSG_UPSERT) {
+                if (value != NULL) *value = node.msg_values[j];
+                return SUCCESS;
+            }
+            // otherwise remember the oldest pending insert
+            have_insert = 1;
+            insert_value = node.msg_values[j];
+        }
+
+        // stored entries are older than any pending insert
+        int i = 0;
+        while (i < node.n && key > node.keys[i]) i++;
+        if (i < node.n && key == node.keys[i]) {
+            if (value != NULL) *value = node.values[i];
+            return SUCCESS;
+        }
+
+        if (node.children[0] == 0) break;
+        current_node_id = node.children[i];
+    }
+
+    if (!have_insert) return ERROR_KEY_NOT_FOUND;
+    if (value != NULL) *value = insert_value;
+    return SUCCESS;
+}
+
+// helper to order pending messages by key, oldest first
+static int compare_pending(const void *a, const void *b) {
+    const Pending *x = a, *y = b;
+    if (x->key != y->key) return x->key < y->key ? -1 : 1;
+    if (x->depth != y->depth) return y->depth - x->depth;
+    return x->seq - y->seq;
+}
+
+// helper to add a message to the heap of a view
+static void heap_push(BufferView *v, const Pending *p) {
+    if (v->count == v->cap) {
+        v->cap = v->cap ? v->cap * 2 : 256;
+        v->heap = realloc(v->heap, v->cap * sizeof(Pending));
+        if (!v->heap) die("realloc");
+    }
+    size_t i = v->count++;
+    while (i > 0 && compare_pending(p, &v->heap[(i - 1) / 2]) < 0) {
+        v->heap[i] = v->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    v->heap[i] = *p;
+}
+
+// helper to take the smallest message off the heap of a view
+static Pending heap_pop(BufferView *v) {
+    Pending top = v->heap[0];
+    Pending last = v->heap[--v->count];
+    size_t i = 0;
+    while (1) {
+        size_t c = 2 * i + 1;
+        if (c >= v->count) break;
+        if (c + 1 < v->count && compare_pending(&v->heap[c + 1], &v->heap[c]) < 0) c++;
+        if (compare_pending(&v->heap[c], &last) >= 0) break;
+        v->heap[i] = v->heap[c];
+        i = c;
+    }
+    if (v->count > 0) v->heap[i] = last;
+    return top;
+}
+
+// helper to add a copy to the key being collected
+static void add_copy(BufferView *v, uint64_t value, int depth, int visible) {
+    if (v->ncopies == v->copies_cap) {
+        v->copies_cap = v->copies_cap ? v->copies_cap * 2 : 16;
+        v->copies = realloc(v->copies, v->copies_cap * sizeof(Copy));
+        if (!v->copies) die("realloc");
+    }
+    v->copies[v->ncopies].value = value;
+    v->copies[v->ncopies].depth = depth;
+    v->copies[v->ncopies].visible = visible;
+    v->ncopies++;
+}
+
+// helper to apply the messages for the key being collected, oldest first,
+// the way flushing them down would, and report its copies
+static void close_key(BufferView *v) {
+    while (v->count > 0 && v->heap[0].key == v->key) {
+        Pending p = heap_pop(v);
+
+        // an upsert reaches the shallowest copy on its path first, the first
+        // one if a node holds several; inserts go after the existing copies
+        Copy *target = NULL;
+        if (p.type == MSG_UPSERT) {
+            for (size_t i = 0; i < v->ncopies; i++) {
+                if (!target || v->copies[i].depth < target->depth) target = &v->copies[i];
+            }
+        }
+        if (target) {
+            target->value = p.value;
+            target->visible = 1;
+        } else {
+            add_copy(v, p.value, NEW_COPY, 1);
+        }
+    }
+
+    for (size_t i = 0; i < v->ncopies; i++) {
+        if (v->copies[i].visible) v->fn(v->ctx, v->key, v->copies[i].value);
+    }
+    v->ncopies = 0;
+    v->open = 0;
+}
+
+// helper to report the keys that only have messages, up to (not including) key
+static void close_pending(BufferView *v, uint64_t key, int all) {
+    while (v->count > 0 && (all || v->heap[0].key < key)) {
+        v->open = 1;
+        v->key = v->heap[0].key;
+        close_key(v);
+    }
+}
+
+BufferView* buffer_view_new(uint64_t low, uint64_t high, ScanFn fn, void *ctx) {
+    BufferView *v = calloc(1, sizeof(*v));
+    if (!v) die("calloc");
+    v->fn = fn;
+    v->ctx = ctx;
+    v->low = low;
+    v->high = high;
+    return v;
+}
+
+void buffer_view_node(BufferView *v, const BTNode *node, int depth) {
+    if (node->children[0] == 0) return;
+    for (int j = 0; j < node->nmsgs; j++) {
+        if (node->msg_keys[j] < v->low || node->msg_keys[j] > v->high) continue;
+        Pending p = { node->msg_keys[j], node->msg_values[j], node->msg_types[j], depth, j };
+        heap_push(v, &p);
+    }
+}
+
+void buffer_view_pair(BufferView *v, uint64_t key, uint64_t value, int depth, int visible) {
+    if (key < v->low || key > v->high) return;
+
+    // every message for a key sits on the path to its copies, so the ones
+    // for smaller keys are all known by the time a larger key shows up
+    if (!v->open || key != v->key) {
+        if (v->open) close_key(v);
+        close_pending(v, key, 0);
+        v->open = 1;
+        v->key = key;
+    }
+    add_copy(v, value, depth, visible);
+}
+
+void buffer_view_finish(BufferView *v) {
+    if (v->open) close_key(v);
+    close_pending(v, 0, 1);
+}
+
+void buffer_view_free(BufferView *v) {
+    if (!v) return;
+    free(v->heap);
+    free(v->copies);
+    free(v);
+}
+
+// helper to feed the pairs and messages of a subtree to a view, in key order
+static void view_subtree(BTree *t, uint64_t id, int depth, uint64_t min_gen, BufferView *v) {
+    BTNode node;
+    read_node(t, id, &node);
+    if (node.max_gen < min_gen) return;
+    buffer_view_node(v, &node, depth);
+
+    // entries of nodes written before min_gen only matter to the messages
+    int visible = node.gen >= min_gen;
+    int leaf = node.children[0] == 0;
+    for (int i = 0; i <= node.n; i++) {
+        // copies may sit on both sides of an equal separator
+        if (!leaf && (i == 0 || node.keys[i-1] <= v->high) && (i == node.n || node.keys[i] >= v->low)) {
+            view_subtree(t, node.children[i], depth + 1, min_gen, v);
+        }
+        if (i == node.n || node.keys[i] > v->high) break;
+        buffer_view_pair(v, node.keys[i], node.values[i], depth, visible);
+    }
+}
+
+void buffer_scan(BTree *t, uint64_t min_gen, ScanFn fn, void *ctx) {
+    BufferView *v = buffer_view_new(0, UINT64_MAX, fn, ctx);
+    view_subtree(t, t->hdr.root_block, 0, min_gen, v);
+    buffer_view_finish(v);
+    buffer_view_free(v);
+}
+
+void buffer_scan_key(BTree *t, uint64_t key, ScanFn fn, void *ctx) {
+    BufferView *v = buffer_view_new(key, key, fn, ctx);
+    view_subtree(t, t->hdr.root_block, 0, 0, v);
+    buffer_view_finish(v);
+    buffer_view_free(v);
+}
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "cache.h"
+#include "constants.h"
+#include "io.h"
+#include "utils.h"
+
+// helper to find the hash chain of a block (Fibonacci hashing)
+static CacheEntry **bucket(BlockCache *c, uint64_t id) {
+    return &c->buckets[(id * 0x9e3779b97f4a7c15ULL) % c->nbuckets];
+}
+
+// helper to unlink an entry from the LRU list
+static void lru_unlink(CacheEntry *e) {
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+// helper to link an entry as the most recently used
+static void lru_push_front(BlockCache *c, CacheEntry *e) {
+    e->prev = &c->lru;
+    e->next = c->lru.next;
+    c->lru.next->prev = e;
+    c->lru.next = e;
+}
+
+// helper to link an entry as the least recently used
+static void lru_push_back(BlockCache *c, CacheEntry *e) {
+    e->next = &c->lru;
+    e->prev = c->lru.prev;
+    c->lru.prev->next = e;
+    c->lru.prev = e;
+}
+
+// helper to look a block up without touching the LRU order
+static CacheEntry *lookup(BlockCache *c, uint64_t id) {
+    for (CacheEntry *e = *bucket(c, id); e; e = e->hnext) {
+        if (e->block_id == id) return e;
+    }
+    return NULL;
+}
+
+BlockCache* cache_new(size_t capacity) {
+    if (capacity == 0) capacity = 1;
+
+    BlockCache *c = calloc(1, sizeof(*c));
+    if (!c) die("calloc");
+    c->capacity = capacity;
+    c->nbuckets = capacity * 2;
+    c->entries = calloc(capacity, sizeof(CacheEntry));
+    c->buckets = calloc(c->nbuckets, sizeof(CacheEntry *));
+    // frames come from the aligned allocator, so they can be read into directly
+    c->frames = io_alloc(capacity * BLOCK_SIZE);
+    if (!c->entries || !c->buckets || !c->frames) die("malloc");
+
+    for (size_t i = 0; i < capacity; i++) c->entries[i].data = c->frames + i * BLOCK_SIZE;
+    c->lru.prev = c->lru.next = &c->lru;
+    pthread_mutex_init(&c->mutex, NULL);
+    return c;
+}
+
+void cache_free(BlockCache *c) {
+    if (!c) return;
+    pthread_mutex_destroy(&c->mutex);
+    io_free(c->frames, c->capacity * BLOCK_SIZE);
+    free(c->buckets);
+    free(c->entries);
+    free(c);
+}
+
+int cache_get(BlockCache *c, uint64_t id, void *buf) {
+    pthread_mutex_lock(&c->mutex);
+    CacheEntry *e = lookup(c, id);
+    if (!e) {
+        c->misses++;
+        pthread_mutex_unlock(&c->mutex);
+        return 0;
+    }
+    c->hits++;
+    lru_unlink(e);
+    lru_push_front(c, e);
+    memcpy(buf, e->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->mutex);
+    return 1;
+}
+
+void cache_put(BlockCache *c, uint64_t id, const void *buf) {
+    pthread_mutex_lock(&c->mutex);
+    CacheEntry *e = lookup(c, id);
+    if (e) {
+        lru_unlink(e);
+    } else if (c->count < c->capacity) {
+        // fill unused entries first
+        e = &c->entries[c->count++];
+        e->block_id = id;
+        e->hnext = *bucket(c, id);
+        *bucket(c, id) = e;
+    } else {
+        // evict the least recently used block and reuse its entry
+        e = c->lru.prev;
+        lru_unlink(e);
+        CacheEntry **p = bucket(c, e->block_id);
+        while (*p != e) p = &(*p)->hnext;
+        *p = e->hnext;
+
+        e->block_id = id;
+        e->hnext = *bucket(c, id);
+        *bucket(c, id) = e;
+    }
+    memcpy(e->data, buf, BLOCK_SIZE);
+    lru_push_front(c, e);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+int cache_load(BlockCache *c, int fd, uint64_t id, void *buf) {
+    // the read happens under the mutex, so a write of the handle either
+    // comes before it or replaces the loaded copy afterwards
+    pthread_mutex_lock(&c->mutex);
+    int result = 1;
+    CacheEntry *e = lookup(c, id);
+    if (!e && c->count == c->capacity) {
+        result = 0;
+    } else if (!e) {
+        e = &c->entries[c->count];
+        if (io_read_node(fd, id, e->data) < 0) {
+            result = -1;
+        } else {
+            c->count++;
+            e->block_id = id;
+            e->hnext = *bucket(c, id);
+            *bucket(c, id) = e;
+            // loaded blocks are the first to go if nothing uses them
+            lru_push_back(c, e);
+        }
+    }
+    if (result == 1 && buf) memcpy(buf, e->data, BLOCK_SIZE);
+    pthread_mutex_unlock(&c->mutex);
+    return result;
+}
+
+void cache_clear(BlockCache *c) {
+    pthread_mutex_lock(&c->mutex);
+    c->count = 0;
+    memset(c->buckets, 0, c->nbuckets * sizeof(CacheEntry *));
+    c->lru.prev = c->lru.next = &c->lru;
+    pthread_mutex_unlock(&c->mutex);
+}
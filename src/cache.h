@@ -0,0 +1,90 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Block cache of a direct I/O index, which bypasses the kernel page cache
+ */
+
+/**
+ * Cached block, linked into a hash chain and the LRU list
+ */
+typedef struct CacheEntry {
+    uint64_t           block_id;
+    uint8_t           *data;    // BLOCK_SIZE bytes, aligned for direct I/O
+    struct CacheEntry *hnext;   // next entry of the hash chain
+    struct CacheEntry *prev;    // LRU neighbours, most recent first
+    struct CacheEntry *next;
+} CacheEntry;
+
+/**
+ * Write-through LRU cache of raw blocks. Writes go to the file first and
+ * then replace the cached copy, so the file is always current. The handle
+ * and its warm-up thread share the cache, so every call takes its mutex.
+ */
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t       capacity;      // number of blocks
+    size_t       count;         // blocks in use
+    CacheEntry  *entries;       // capacity entries
+    uint8_t     *frames;        // capacity * BLOCK_SIZE bytes
+    CacheEntry **buckets;       // hash table of nbuckets chains
+    size_t       nbuckets;
+    CacheEntry   lru;           // list head, lru.next is the most recent
+    uint64_t     hits;
+    uint64_t     misses;
+} BlockCache;
+
+/**
+ * Create an empty cache
+ * @param capacity  Number of blocks to hold (at least 1)
+ * @return          New cache (dies on allocation failure)
+ */
+BlockCache* cache_new(size_t capacity);
+
+/**
+ * Free a cache
+ * @param c         Cache to free (may be NULL)
+ */
+void cache_free(BlockCache *c);
+
+/**
+ * Copy a cached block
+ * @param c         Cache
+ * @param id        Block id
+ * @param buf       Buffer of BLOCK_SIZE bytes to copy into
+ * @return          1 on a hit, 0 if the block is not cached
+ */
+int cache_get(BlockCache *c, uint64_t id, void *buf);
+
+/**
+ * Store the current contents of a block, evicting the least recently used
+ * block if the cache is full
+ * @param c         Cache
+ * @param id        Block id
+ * @param buf       BLOCK_SIZE bytes of block contents
+ */
+void cache_put(BlockCache *c, uint64_t id, const void *buf);
+
+/**
+ * Read a block from the file into an unused entry, unless it is cached
+ * already. Nothing is evicted and the hit counters are left alone.
+ * @param c         Cache
+ * @param fd        File descriptor of the index (opened for direct I/O)
+ * @param id        Block id
+ * @param buf       Buffer of BLOCK_SIZE bytes to copy the block into (may be NULL)
+ * @return          1 if the block is cached, 0 if the cache is full,
+ *                  -1 on a read error
+ */
+int cache_load(BlockCache *c, int fd, uint64_t id, void *buf);
+
+/**
+ * Drop every cached block, after another process changed the file
+ * @param c         Cache
+ */
+void cache_clear(BlockCache *c);
+
+#endif /* CACHE_H */
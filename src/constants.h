@@ -13,7 +13,12 @@
 /**
  * Size of the header (bytes)
  */
-#define HEADER_SIZE     24
+#define HEADER_SIZE     96
+
+/**
+ * Default Bloom filter bits per key (about 1% false positives)
+ */
+#define BLOOM_DEFAULT_BITS  10
 
 /**
  * Magic number to identify index files
@@ -31,6 +36,36 @@
 #define MAX_KEYS        (2 * DEGREE - 1)
 #define MAX_CHILDREN    (2 * DEGREE)
 
+/**
+ * Minimum degree of nodes that also store subtree sizes
+ */
+#define COUNTED_DEGREE  7
+
+/**
+ * Minimum degree of internal nodes that also buffer pending messages, and
+ * the number of messages such a node can hold
+ */
+#define BUFFERED_DEGREE 3
+#define BUFFER_MESSAGES 19
+
+/**
+ * Default block cache size of a direct I/O index (blocks, 1 MiB)
+ */
+#define CACHE_DEFAULT_BLOCKS 2048
+
+/**
+ * Most blocks recorded in the hot-block manifest (as many as the default
+ * block cache holds), and number of tree levels (from the root) that are
+ * read in the background when an index is opened
+ */
+#define HOT_MAX_BLOCKS  2048
+#define WARM_LEVELS     3
+
+/**
+ * Number of CSV pairs bt_load sorts and merges into the tree at once
+ */
+#define LOAD_BATCH_PAIRS 65536
+
 /**
  * B-tree header structure
  */
@@ -38,9 +73,39 @@ typedef struct {
     uint64_t magic;           // Magic number for file validation (8 bytes)
     uint64_t root_block;      // Block number of the root node (8 bytes)
     uint64_t next_free_block; // Next available block number for allocation (8 bytes)
-    uint8_t  reserved[BLOCK_SIZE - 24]; // Padding to fill header block
+    uint64_t flags;           // Index mode flags, see BT_FLAG_* (8 bytes)
+    uint64_t generation;      // Number of committed modifications (8 bytes)
+    uint64_t free_head;       // First block of the free block list, 0 if none (8 bytes)
+    uint64_t bloom_bits;      // Bloom filter bits per key, 0 if none (8 bytes)
+    uint64_t shard_count;     // Number of shard files of a sharded index (8 bytes)
+    uint64_t layout;          // Key, value and block sizes of a typed index, 0 otherwise (8 bytes)
+    uint64_t cache_blocks;    // Block cache size of a direct I/O index (8 bytes)
+    uint64_t hash_depth;      // Directory depth (bits) of a hash index (8 bytes)
+    uint64_t changes;         // Number of changes published to other processes (8 bytes)
+    uint8_t  reserved[BLOCK_SIZE - HEADER_SIZE]; // Padding to fill header block
 } BTHeader;
 
+/**
+ * Index mode flags (stored in the header, chosen at create time)
+ */
+#define BT_FLAG_COW         0x1  // copy-on-write shadow paging
+#define BT_FLAG_BLOOM       0x2  // Bloom filter sidecar for negative lookups
+#define BT_FLAG_COUNTED     0x4  // nodes store subtree sizes (order statistics)
+#define BT_FLAG_SHARDED     0x8  // manifest of shard files, holds no tree itself
+#define BT_FLAG_BUFFERED    0x10 // internal nodes buffer pending writes (B-epsilon)
+#define BT_FLAG_TYPED       0x20 // nodes written by the C++ template (btree.hpp)
+#define BT_FLAG_DIRECT      0x40 // O_DIRECT I/O through a private block cache
+#define BT_FLAG_HASH        0x80 // extendible hash engine instead of a B-tree
+#define BT_FLAG_FROZEN      0x100 // read-only snapshot of sorted pages and a learned model
+#define BT_FLAG_VALUES      0x200 // secondary value-to-key index in <index>.vidx
+
+/**
+ * Duplicate key policies of a merge (a key present in both inputs)
+ */
+#define BT_MERGE_BOTH       0    // keep every copy, those of the first input first
+#define BT_MERGE_FIRST      1    // keep only the copies of the first input
+#define BT_MERGE_SECOND     2    // keep only the copies of the second input
+
 /**
  * Status codes
  */
@@ -48,5 +113,6 @@ typedef struct {
 #define ERROR_FILE_EXISTS   1
 #define ERROR_IO            2
 #define ERROR_KEY_NOT_FOUND 3
+#define ERROR_UNSUPPORTED   4
 
 #endif /* CONSTANTS_H */
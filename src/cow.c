@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "btree_internal.h"
+#include "io.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Copy-on-write shadow paging
+ *
+ * Published blocks are never modified. An insert copies every node on its
+ * root-to-leaf path to fresh blocks and then publishes the new root with a
+ * single header write. Readers pin the generation they opened with by
+ * holding a read lock on byte (SNAPSHOT_LOCK_BASE + generation); a block
+ * released by commit g is reused only once no lock is held below g.
+ */
+
+// lock bytes used for snapshot pins, far past any real block
+#define SNAPSHOT_LOCK_BASE  ((uint64_t)1 << 48)
+
+// number of (block id, generation) pairs per free list block
+#define FREE_PER_BLOCK      ((BLOCK_SIZE - 16) / 16)
+
+// Block of the persisted free list chain
+typedef struct {
+    uint64_t next;                       // next block of the chain (0 if last)
+    uint64_t count;                      // number of entries in this block
+    uint64_t entries[FREE_PER_BLOCK][2]; // (block id, generation released at)
+} FreeListBlock;
+
+// helper to append a block released at a generation
+static void retire_block(BTree *t, uint64_t block_id, uint64_t gen) {
+    if (t->retired_count == t->retired_cap) {
+        t->retired_cap = t->retired_cap ? t->retired_cap * 2 : 64;
+        t->retired = realloc(t->retired, t->retired_cap * sizeof(FreedBlock));
+        if (!t->retired) die("realloc");
+    }
+    t->retired[t->retired_count].block_id = block_id;
+    t->retired[t->retired_count].gen = gen;
+    t->retired_count++;
+}
+
+// helper to append a block that can be reused right away
+static void push_free(BTree *t, uint64_t block_id) {
+    if (t->free_count == t->free_cap) {
+        t->free_cap = t->free_cap ? t->free_cap * 2 : 64;
+        t->free_ids = realloc(t->free_ids, t->free_cap * sizeof(uint64_t));
+        if (!t->free_ids) die("realloc");
+    }
+    t->free_ids[t->free_count++] = block_id;
+}
+
+// helper to take over the free list persisted by the previous writer
+static void load_free_list(BTree *t) {
+    if (t->free_loaded) return;
+    t->free_loaded = 1;
+
+    uint64_t id = t->hdr.free_head;
+    while (id != 0) {
+        FreeListBlock blk IO_ALIGNED;
+        if (io_read_node(t->fd, id, &blk) < 0) die("io_read_node");
+        uint64_t count = be64_to_host(blk.count);
+        if (count > FREE_PER_BLOCK) die("corrupt free list");
+
+        // entries were saved oldest first, so the list stays ordered
+        for (uint64_t i = 0; i < count; i++) {
+            retire_block(t, be64_to_host(blk.entries[i][0]),
+                         be64_to_host(blk.entries[i][1]));
+        }
+        // the chain block itself is free once the next commit drops free_head
+        retire_block(t, id, t->hdr.generation + 1);
+        id = be64_to_host(blk.next);
+    }
+    t->hdr.free_head = 0;
+}
+
+// helper to move released blocks that no pinned snapshot can reach to the free list
+static void reclaim(BTree *t) {
+    size_t i = 0;
+    while (i < t->retired_count) {
+        uint64_t gen = t->retired[i].gen;
+        // blocks released by a commit that is not published yet stay put
+        if (gen > t->hdr.generation) break;
+
+        // readers pinned below gen may still see these blocks
+        if (gen > 0 && io_lock_held(t->fd, SNAPSHOT_LOCK_BASE, gen) != 0) break;
+
+        // everything released at this generation is free
+        while (i < t->retired_count && t->retired[i].gen == gen) {
+            push_free(t, t->retired[i].block_id);
+            i++;
+        }
+    }
+
+    // drop the reclaimed prefix
+    memmove(t->retired, t->retired + i, (t->retired_count - i) * sizeof(FreedBlock));
+    t->retired_count -= i;
+}
+
+// helper to move this handle's pin to a new generation
+static void move_pin(BTree *t, uint64_t gen) {
+    if (io_lock(t->fd, F_RDLCK, SNAPSHOT_LOCK_BASE + gen, 1, 1) < 0) die("io_lock");
+    if (t->pinned && t->pinned_gen != gen) {
+        io_lock(t->fd, F_UNLCK, SNAPSHOT_LOCK_BASE + t->pinned_gen, 1, 0);
+    }
+    t->pinned = 1;
+    t->pinned_gen = gen;
+}
+
+// helper to give a node a new block and release its old one at the next commit
+static void shadow_node(BTree *t, BTNode *node, uint64_t parent_id) {
+    retire_block(t, node->block_id, t->hdr.generation + 1);
+    node->block_id = alloc_node(t);
+    node->parent_id = parent_id;
+}
+
+int cow_pin_snapshot(BTree *t) {
+    int moved = 0;
+    while (1) {
+        move_pin(t, t->hdr.generation);
+
+        // a commit between reading the header and pinning could already have
+        // reused blocks of this generation, so confirm it is still current
+        BTHeader hdr;
+        lock_read_header(t, &hdr);
+        if (hdr.generation == t->hdr.generation && hdr.root_block == t->hdr.root_block) return moved;
+
+        // take the whole header over, never a root of one commit with the
+        // generation of another
+        t->hdr = hdr;
+        moved = 1;
+    }
+}
+
+uint64_t cow_alloc(BTree *t) {
+    load_free_list(t);
+    if (t->free_count == 0) reclaim(t);
+    if (t->free_count == 0) return 0;
+    return t->free_ids[--t->free_count];
+}
+
+// helper to find an entry with the key in a node (-1 if none)
+static int find_key(const BTNode *node, uint64_t key) {
+    for (int i = 0; i < node->n; i++) {
+        if (node->keys[i] == key) return i;
+    }
+    return -1;
+}
+
+void cow_insert(BTree *t, uint64_t key, uint64_t value, int update) {
+    load_free_list(t);
+
+    // copy the root, or put a new root above it if it is full
+    BTNode cur, child, sibling;
+    read_node(t, t->hdr.root_block, &cur);
+    if (cur.n == t->max_keys) {
+        uint64_t total = node_total(&cur);
+        memset(&cur, 0, sizeof(cur));
+        cur.block_id = alloc_node(t);
+        cur.children[0] = t->hdr.root_block;
+        cur.counts[0] = total;
+    } else {
+        shadow_node(t, &cur, 0);
+    }
+    uint64_t new_root = cur.block_id;
+
+    // walk down copying each node; the copies are fresh blocks, so they can
+    // be written in any order before the header is published
+    while (cur.children[0] != 0) {
+        // an update stops at the first copy of the key, like a search
+        if (update && find_key(&cur, key) >= 0) break;
+
+        // find the child to descend into
+        int i = cur.n - 1;
+        while (i >= 0 && key < cur.keys[i]) i--;
+        i++;
+
+        // copy the child and point the copy of the parent at it
+        read_node(t, cur.children[i], &child);
+        shadow_node(t, &child, cur.block_id);
+        cur.children[i] = child.block_id;
+
+        // split it if full, keeping only the half we descend into in memory
+        if (child.n == t->max_keys) {
+            split_node(t, &cur, i, &child, &sibling, alloc_node(t));
+
+            // an update may find its key in the median that just moved up
+            if (update && cur.keys[i] == key) {
+                write_node(t, child.block_id, &child);
+                write_node(t, sibling.block_id, &sibling);
+                break;
+            }
+            if (key > cur.keys[i]) {
+                write_node(t, child.block_id, &child);
+                child = sibling;
+                i++;
+            } else {
+                write_node(t, sibling.block_id, &sibling);
+            }
+        }
+
+        // the new entry ends up below this child
+        if (!update) cur.counts[i]++;
+
+        write_node(t, cur.block_id, &cur);
+        cur = child;
+    }
+
+    // update the copied node, or insert into the copied leaf
+    int found = update ? find_key(&cur, key) : -1;
+    if (found >= 0) cur.values[found] = value;
+    else leaf_insert(&cur, key, value);
+    write_node(t, cur.block_id, &cur);
+
+    // publish the new root
+    t->hdr.root_block = new_root;
+    t->hdr.generation++;
+    if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+    t->dirty = 0;
+
+    // this handle now reads the new generation
+    move_pin(t, t->hdr.generation);
+}
+
+void cow_close(BTree *t) {
+    if (t->free_loaded) {
+        // reuse what we can before saving, so the next writer starts clean
+        reclaim(t);
+
+        // chain blocks are taken from the free list itself, or from the end of
+        // the file when it runs out; the next writer frees them
+        uint64_t *chain = NULL;
+        size_t nblocks = 0;
+        while (nblocks * FREE_PER_BLOCK < t->free_count + t->retired_count) {
+            chain = realloc(chain, (nblocks + 1) * sizeof(uint64_t));
+            if (!chain) die("realloc");
+            chain[nblocks++] = t->free_count > 0 ? t->free_ids[--t->free_count]
+                                                 : t->hdr.next_free_block++;
+        }
+        size_t total = t->free_count + t->retired_count;
+
+        // reusable blocks are stored with generation 0, then the retired ones
+        size_t pos = 0;
+        for (size_t b = 0; b < nblocks; b++) {
+            FreeListBlock blk IO_ALIGNED;
+            memset(&blk, 0, sizeof(blk));
+            uint64_t count = 0;
+            while (count < FREE_PER_BLOCK && pos < total) {
+                uint64_t id, gen;
+                if (pos < t->free_count) {
+                    id = t->free_ids[pos];
+                    gen = 0;
+                } else {
+                    id = t->retired[pos - t->free_count].block_id;
+                    gen = t->retired[pos - t->free_count].gen;
+                }
+                blk.entries[count][0] = host_to_be64(id);
+                blk.entries[count][1] = host_to_be64(gen);
+                count++;
+                pos++;
+            }
+            blk.count = host_to_be64(count);
+            blk.next = host_to_be64(b + 1 < nblocks ? chain[b + 1] : 0);
+            if (io_write_node(t->fd, chain[b], &blk) < 0) die("io_write_node");
+        }
+
+        // publish the chain
+        t->hdr.free_head = nblocks ? chain[0] : 0;
+        if (io_write_header(t->fd, &t->hdr) < 0) perror("io_write_header");
+        free(chain);
+    }
+
+    free(t->free_ids);
+    free(t->retired);
+}
@@ -0,0 +1,289 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Frozen snapshots
+ *
+ * A frozen snapshot is a read-only copy of an index: its pairs in key order,
+ * packed PAGE_PAIRS to a block, followed by a piecewise-linear model that
+ * maps a key to the position of its first copy. Each segment of the model
+ * starts at a key, predicts positions on a straight line from there, and is
+ * built so that every key it covers is within FROZEN_EPSILON positions of
+ * its prediction (a shrinking cone over the sorted keys). The model is small
+ * enough to stay in memory, so a lookup binary searches the segment starts,
+ * reads at most two pages around the prediction and searches inside them.
+ *
+ * File layout: header block, pages 1..npages, then the model (big-endian):
+ * count, nsegs, and nsegs triples of first key, slope bits, first position.
+ */
+
+// pairs per page
+#define PAGE_PAIRS      (BLOCK_SIZE / 16)
+
+// largest distance between a predicted and a real position; the search
+// window of 2 * (FROZEN_EPSILON + 1) + 1 positions spans at most two pages
+#define FROZEN_EPSILON  (PAGE_PAIRS / 2 - 1)
+
+// segment being built, with the range of slopes that still fit every key
+typedef struct {
+    uint64_t key;       // first key
+    uint64_t pos;       // its position
+    double   lo;        // smallest slope that fits
+    double   hi;        // largest slope that fits
+    int      open;
+} Cone;
+
+// state of a freeze in progress
+typedef struct {
+    BTree    *t;        // handle of the snapshot file
+    uint8_t  *page;     // page being filled
+    uint64_t  count;    // pairs written so far
+    uint64_t  last_key;
+    Cone      cone;
+    FrozenModel model;
+    size_t    cap;
+} FreezeCtx;
+
+// helper to close the current segment and add it to the model
+static void end_segment(FreezeCtx *fz) {
+    Cone *c = &fz->cone;
+    FrozenModel *m = &fz->model;
+    if (m->nsegs == fz->cap) {
+        fz->cap = fz->cap ? fz->cap * 2 : 64;
+        m->keys = realloc(m->keys, fz->cap * sizeof(uint64_t));
+        m->slopes = realloc(m->slopes, fz->cap * sizeof(double));
+        m->starts = realloc(m->starts, fz->cap * sizeof(uint64_t));
+        if (!m->keys || !m->slopes || !m->starts) die("realloc");
+    }
+    // any slope in the cone works, the middle leaves the most slack
+    double slope = c->hi < 1e300 ? (c->lo + c->hi) / 2 : c->lo;
+    m->keys[m->nsegs] = c->key;
+    m->slopes[m->nsegs] = slope;
+    m->starts[m->nsegs] = c->pos;
+    m->nsegs++;
+    c->open = 0;
+}
+
+// helper to fit the first copy of a key into the model
+static void model_add(FreezeCtx *fz, uint64_t key, uint64_t pos) {
+    Cone *c = &fz->cone;
+    if (c->open) {
+        // slopes that keep this key within the error bound
+        double dx = (double)(key - c->key);
+        double lo = ((double)pos - FROZEN_EPSILON - (double)c->pos) / dx;
+        double hi = ((double)pos + FROZEN_EPSILON - (double)c->pos) / dx;
+        if (lo <= c->hi && hi >= c->lo) {
+            if (lo > c->lo) c->lo = lo;
+            if (hi < c->hi) c->hi = hi;
+            return;
+        }
+        end_segment(fz);
+    }
+
+    // start a new segment at this key
+    c->key = key;
+    c->pos = pos;
+    c->lo = 0;
+    c->hi = 1e308;
+    c->open = 1;
+}
+
+// helper to write the page being filled (cursor loop)
+static void flush_page(FreezeCtx *fz) {
+    uint64_t id = 1 + (fz->count - 1) / PAGE_PAIRS;
+    write_block(fz->t, id, fz->page);
+    memset(fz->page, 0, BLOCK_SIZE);
+}
+
+int frozen_write(BTree *src, const char *path) {
+    if (io_file_exists(path)) return ERROR_FILE_EXISTS;
+
+    // the snapshot is written through a handle of its own
+    BTree *t = calloc(1, sizeof(*t));
+    if (!t) die("calloc");
+    t->fd = io_open(path, O_RDWR|O_CREAT);
+    if (t->fd < 0) die("io_open");
+
+    FreezeCtx fz = {0};
+    fz.t = t;
+    fz.page = io_alloc(BLOCK_SIZE);
+    if (!fz.page) die("malloc");
+    memset(fz.page, 0, BLOCK_SIZE);
+
+    // stream the pairs in key order into pages, fitting the model as we go
+    BTCursor *cursor = bt_cursor_open(src);
+    uint64_t key, value;
+    while (bt_cursor_next(cursor, &key, &value) == SUCCESS) {
+        if (fz.count == 0 || key != fz.last_key) model_add(&fz, key, fz.count);
+        fz.last_key = key;
+
+        size_t slot = fz.count % PAGE_PAIRS;
+        put64(fz.page, 16 * slot, key);
+        put64(fz.page, 16 * slot + 8, value);
+        fz.count++;
+        if (fz.count % PAGE_PAIRS == 0) flush_page(&fz);
+    }
+    bt_cursor_close(cursor);
+    if (fz.count % PAGE_PAIRS != 0) flush_page(&fz);
+    if (fz.cone.open) end_segment(&fz);
+
+    // the model follows the pages
+    uint64_t npages = (fz.count + PAGE_PAIRS - 1) / PAGE_PAIRS;
+    size_t bytes = 16 + 24 * fz.model.nsegs;
+    size_t nblocks = (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    uint8_t *buf = io_alloc(nblocks * BLOCK_SIZE);
+    if (!buf) die("malloc");
+    memset(buf, 0, nblocks * BLOCK_SIZE);
+    put64(buf, 0, fz.count);
+    put64(buf, 8, fz.model.nsegs);
+    for (uint64_t s = 0; s < fz.model.nsegs; s++) {
+        uint64_t bits;
+        memcpy(&bits, &fz.model.slopes[s], sizeof(bits));
+        put64(buf, 16 + 24*s, fz.model.keys[s]);
+        put64(buf, 24 + 24*s, bits);
+        put64(buf, 32 + 24*s, fz.model.starts[s]);
+    }
+    for (size_t b = 0; b < nblocks; b++) write_block(t, 1 + npages + b, buf + b * BLOCK_SIZE);
+
+    // the header goes last, so a partial snapshot never opens
+    memcpy(&t->hdr.magic, MAGIC_NUMBER, 8);
+    t->hdr.flags = BT_FLAG_FROZEN;
+    t->hdr.root_block = 1 + npages;
+    t->hdr.next_free_block = 1 + npages + nblocks;
+    t->hdr.generation = src->hdr.generation;
+    if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+
+    printf("Froze %llu key-value pairs into %llu pages and %llu model segments\n",
+           (unsigned long long)fz.count, (unsigned long long)npages,
+           (unsigned long long)fz.model.nsegs);
+
+    io_free(buf, nblocks * BLOCK_SIZE);
+    io_free(fz.page, BLOCK_SIZE);
+    free(fz.model.keys);
+    free(fz.model.slopes);
+    free(fz.model.starts);
+    io_close(t->fd);
+    free(t);
+    return SUCCESS;
+}
+
+void frozen_open(BTree *t) {
+    FrozenModel *m = calloc(1, sizeof(*m));
+    if (!m) die("calloc");
+
+    // the model runs from root_block to the end of the file
+    size_t nblocks = t->hdr.next_free_block - t->hdr.root_block;
+    uint8_t *buf = io_alloc(nblocks * BLOCK_SIZE);
+    if (!buf) die("malloc");
+    for (size_t b = 0; b < nblocks; b++) read_block(t, t->hdr.root_block + b, buf + b * BLOCK_SIZE);
+    m->count = get64(buf, 0);
+    m->nsegs = get64(buf, 8);
+    if (16 + 24 * m->nsegs > nblocks * BLOCK_SIZE) die("corrupt frozen snapshot");
+
+    m->keys = malloc(m->nsegs * sizeof(uint64_t) + 1);
+    m->slopes = malloc(m->nsegs * sizeof(double) + 1);
+    m->starts = malloc(m->nsegs * sizeof(uint64_t) + 1);
+    if (!m->keys || !m->slopes || !m->starts) die("malloc");
+    for (uint64_t s = 0; s < m->nsegs; s++) {
+        uint64_t bits = get64(buf, 24 + 24*s);
+        m->keys[s] = get64(buf, 16 + 24*s);
+        memcpy(&m->slopes[s], &bits, sizeof(bits));
+        m->starts[s] = get64(buf, 32 + 24*s);
+    }
+    io_free(buf, nblocks * BLOCK_SIZE);
+    t->model = m;
+}
+
+void frozen_close(BTree *t) {
+    if (!t->model) return;
+    free(t->model->keys);
+    free(t->model->slopes);
+    free(t->model->starts);
+    free(t->model);
+    t->model = NULL;
+}
+
+int frozen_search(BTree *t, uint64_t key, uint64_t *value) {
+    FrozenModel *m = t->model;
+    if (m->count == 0 || key < m->keys[0]) return ERROR_KEY_NOT_FOUND;
+
+    // last segment starting at or below the key
+    uint64_t lo = 0, hi = m->nsegs;
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (m->keys[mid] <= key) lo = mid;
+        else hi = mid;
+    }
+
+    // window of positions around the prediction (one extra for rounding)
+    double pred = (double)m->starts[lo] + m->slopes[lo] * (double)(key - m->keys[lo]);
+    double first = pred - FROZEN_EPSILON - 1, last = pred + FROZEN_EPSILON + 1;
+    uint64_t from = first < 0 ? 0 : (uint64_t)first;
+    uint64_t to = last < 0 ? 0 : (uint64_t)last;
+    if (to >= m->count) to = m->count - 1;
+    if (from > to) return ERROR_KEY_NOT_FOUND;
+
+    // read the one or two pages of the window, then binary search it
+    uint8_t pages[2][BLOCK_SIZE] IO_ALIGNED;
+    uint64_t first_page = from / PAGE_PAIRS;
+    uint64_t npages = to / PAGE_PAIRS - first_page + 1;
+    for (uint64_t p = 0; p < npages; p++) read_block(t, 1 + first_page + p, pages[p]);
+
+    uint64_t base = first_page * PAGE_PAIRS;
+    uint64_t a = from - base, b = to - base + 1;
+    while (a < b) {
+        uint64_t mid = a + (b - a) / 2;
+        if (get64(pages[mid / PAGE_PAIRS], 16 * (mid % PAGE_PAIRS)) < key) a = mid + 1;
+        else b = mid;
+    }
+    if (a > to - base) return ERROR_KEY_NOT_FOUND;
+    const uint8_t *slot = pages[a / PAGE_PAIRS] + 16 * (a % PAGE_PAIRS);
+    if (get64(slot, 0) != key) return ERROR_KEY_NOT_FOUND;
+    if (value != NULL) *value = get64(slot, 8);
+    return SUCCESS;
+}
+
+// helper to visit the pairs of a run of pages, with callback or printing
+static void walk_pages(BTree *t, ScanFn fn, void *ctx) {
+    uint64_t count = t->model->count;
+    uint8_t page[BLOCK_SIZE] IO_ALIGNED;
+    for (uint64_t pos = 0; pos < count; pos++) {
+        uint64_t slot = pos % PAGE_PAIRS;
+        if (slot == 0) {
+            read_block(t, 1 + pos / PAGE_PAIRS, page);
+            if (!fn) printf("%sPage[%llu]:", pos ? "\n" : "", (unsigned long long)(1 + pos / PAGE_PAIRS));
+        }
+        uint64_t key = get64(page, 16 * slot), value = get64(page, 16 * slot + 8);
+        if (fn) fn(ctx, key, value);
+        else printf(" (%llu,%llu)", (unsigned long long)key, (unsigned long long)value);
+    }
+    if (!fn && count > 0) printf("\n");
+}
+
+int frozen_next(BTree *t, uint64_t pos, uint8_t *page, uint64_t *key, uint64_t *value) {
+    if (pos >= t->model->count) return ERROR_KEY_NOT_FOUND;
+    uint64_t slot = pos % PAGE_PAIRS;
+    if (slot == 0) read_block(t, 1 + pos / PAGE_PAIRS, page);
+    *key = get64(page, 16 * slot);
+    *value = get64(page, 16 * slot + 8);
+    return SUCCESS;
+}
+
+void frozen_scan(BTree *t, ScanFn fn, void *ctx) {
+    walk_pages(t, fn, ctx);
+}
+
+void frozen_print(BTree *t) {
+    FrozenModel *m = t->model;
+    printf("Frozen Snapshot: %llu pairs, %llu model segments (%llu bytes in memory)\n",
+           (unsigned long long)m->count, (unsigned long long)m->nsegs,
+           (unsigned long long)(m->nsegs * (2 * sizeof(uint64_t) + sizeof(double))));
+    printf("----------------------------\n");
+    walk_pages(t, NULL, NULL);
+}
@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Extendible hashing
+ *
+ * A hash index keeps its pairs in buckets of one block each. The bucket of
+ * a key is found through a directory of 2^depth block ids, indexed by the
+ * low depth bits of the key's hash. The directory is stored in consecutive
+ * blocks starting at root_block, and only the block holding the needed
+ * entry is read, so a lookup costs one directory block and one bucket.
+ *
+ * A full bucket is split in two by one more bit of the hash, and only the
+ * directory entries that pointed to it change. When the bucket already uses
+ * every bit of the directory, the directory doubles first by copying its
+ * entries, never rehashing any pair. Keys are unique: inserting a key that
+ * is present replaces its value.
+ *
+ * Bucket block layout (big-endian): local depth, count, then count pairs
+ * of key and value.
+ */
+
+// pairs per bucket, after the local depth and count
+#define BUCKET_PAIRS    ((BLOCK_SIZE - 16) / 16)
+
+// directory entries per block
+#define DIR_ENTRIES     (BLOCK_SIZE / 8)
+
+// deepest directory (the hash of distinct keys differs, so this is never
+// reached by real data)
+#define HASH_MAX_DEPTH  40
+
+// bucket of pairs, in host endianness
+typedef struct {
+    uint64_t depth;     // hash bits shared by every key of the bucket
+    uint64_t n;
+    uint64_t keys[BUCKET_PAIRS];
+    uint64_t values[BUCKET_PAIRS];
+} Bucket;
+
+// helper to spread the bits of a key (splitmix64 finalizer, a bijection,
+// so distinct keys always end up in different buckets eventually)
+static uint64_t hash_key(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// helper to count the blocks of a directory of the given depth
+static uint64_t dir_blocks(uint64_t depth) {
+    return ((1ULL << depth) + DIR_ENTRIES - 1) / DIR_ENTRIES;
+}
+
+// helper to read a bucket
+static void read_bucket(BTree *t, uint64_t id, Bucket *b) {
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    read_block(t, id, buf);
+    b->depth = get64(buf, 0);
+    b->n = get64(buf, 8);
+    if (b->n > BUCKET_PAIRS) die("corrupt hash bucket");
+    for (uint64_t i = 0; i < b->n; i++) {
+        b->keys[i] = get64(buf, 16 + 16*i);
+        b->values[i] = get64(buf, 24 + 16*i);
+    }
+}
+
+// helper to write a bucket
+static void write_bucket(BTree *t, uint64_t id, const Bucket *b) {
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    memset(buf, 0, sizeof(buf));
+    put64(buf, 0, b->depth);
+    put64(buf, 8, b->n);
+    for (uint64_t i = 0; i < b->n; i++) {
+        put64(buf, 16 + 16*i, b->keys[i]);
+        put64(buf, 24 + 16*i, b->values[i]);
+    }
+    write_block(t, id, buf);
+}
+
+// helper to look up the bucket of a directory entry
+static uint64_t dir_get(BTree *t, uint64_t idx) {
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    read_block(t, t->hdr.root_block + idx / DIR_ENTRIES, buf);
+    return get64(buf, 8 * (idx % DIR_ENTRIES));
+}
+
+// helper to point the entries first, first + stride, ... at a bucket,
+// rewriting each directory block once
+static void dir_set(BTree *t, uint64_t first, uint64_t stride, uint64_t bucket) {
+    uint64_t size = 1ULL << t->hdr.hash_depth;
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    uint64_t idx = first;
+    while (idx < size) {
+        uint64_t block = idx / DIR_ENTRIES;
+        read_block(t, t->hdr.root_block + block, buf);
+        for (; idx < size && idx / DIR_ENTRIES == block; idx += stride) {
+            put64(buf, 8 * (idx % DIR_ENTRIES), bucket);
+        }
+        write_block(t, t->hdr.root_block + block, buf);
+    }
+}
+
+// helper to double the directory, each new entry copying its lower twin
+static void dir_grow(BTree *t) {
+    uint64_t depth = t->hdr.hash_depth;
+    if (depth == HASH_MAX_DEPTH) die("hash directory too large");
+    uint64_t old_blocks = dir_blocks(depth);
+    uint64_t new_blocks = dir_blocks(depth + 1);
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+
+    if (new_blocks == old_blocks) {
+        // small directories grow inside their single block
+        uint64_t size = 1ULL << depth;
+        read_block(t, t->hdr.root_block, buf);
+        memcpy(buf + 8 * size, buf, 8 * size);
+        write_block(t, t->hdr.root_block, buf);
+    } else {
+        // larger ones move to a new run of blocks twice the size; in-place
+        // files have no free list, so the old run is left behind (all of
+        // them add up to less than the current directory)
+        uint64_t first = alloc_node(t);
+        for (uint64_t b = 1; b < new_blocks; b++) alloc_node(t);
+        for (uint64_t b = 0; b < old_blocks; b++) {
+            read_block(t, t->hdr.root_block + b, buf);
+            write_block(t, first + b, buf);
+            write_block(t, first + old_blocks + b, buf);
+        }
+        t->hdr.root_block = first;
+    }
+    t->hdr.hash_depth = depth + 1;
+}
+
+void hash_create(BTree *t) {
+    // one directory entry pointing at one empty bucket
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    Bucket b = {0};
+    t->hdr.hash_depth = 0;
+    t->hdr.root_block = alloc_node(t);
+    uint64_t bucket = alloc_node(t);
+    write_bucket(t, bucket, &b);
+
+    memset(buf, 0, sizeof(buf));
+    put64(buf, 0, bucket);
+    write_block(t, t->hdr.root_block, buf);
+}
+
+void hash_put(BTree *t, uint64_t key, uint64_t value) {
+    uint64_t h = hash_key(key);
+    while (1) {
+        uint64_t id = dir_get(t, h & ((1ULL << t->hdr.hash_depth) - 1));
+        Bucket b;
+        read_bucket(t, id, &b);
+
+        // replace the value of a key that is present
+        for (uint64_t i = 0; i < b.n; i++) {
+            if (b.keys[i] == key) {
+                b.values[i] = value;
+                write_bucket(t, id, &b);
+                return;
+            }
+        }
+
+        // common case: the bucket has room
+        if (b.n < BUCKET_PAIRS) {
+            b.keys[b.n] = key;
+            b.values[b.n] = value;
+            b.n++;
+            write_bucket(t, id, &b);
+            return;
+        }
+
+        // a full bucket that uses every directory bit needs a bigger directory
+        if (b.depth == t->hdr.hash_depth) dir_grow(t);
+
+        // split by the next hash bit, pairs with the bit set move out
+        uint64_t bit = 1ULL << b.depth;
+        Bucket lo = { b.depth + 1, 0 }, hi = { b.depth + 1, 0 };
+        for (uint64_t i = 0; i < b.n; i++) {
+            Bucket *dst = (hash_key(b.keys[i]) & bit) ? &hi : &lo;
+            dst->keys[dst->n] = b.keys[i];
+            dst->values[dst->n] = b.values[i];
+            dst->n++;
+        }
+        uint64_t hi_id = alloc_node(t);
+        write_bucket(t, hi_id, &hi);
+        write_bucket(t, id, &lo);
+
+        // entries that share the bucket's bits and have the new bit set
+        dir_set(t, (h & (bit - 1)) | bit, bit << 1, hi_id);
+
+        // retry, the key's bucket may still be full if all pairs went one way
+    }
+}
+
+int hash_search(BTree *t, uint64_t key, uint64_t *value) {
+    uint64_t h = hash_key(key);
+    Bucket b;
+    read_bucket(t, dir_get(t, h & ((1ULL << t->hdr.hash_depth) - 1)), &b);
+    for (uint64_t i = 0; i < b.n; i++) {
+        if (b.keys[i] == key) {
+            if (value != NULL) *value = b.values[i];
+            return SUCCESS;
+        }
+    }
+    return ERROR_KEY_NOT_FOUND;
+}
+
+// helper to visit each bucket once, in directory order
+static void for_each_bucket(BTree *t, void (*fn)(BTree *t, uint64_t id, const Bucket *b, void *ctx),
+                            void *ctx) {
+    uint64_t size = 1ULL << t->hdr.hash_depth;
+    uint8_t *seen = calloc((size + 7) / 8, 1);
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    uint64_t loaded = UINT64_MAX;
+    if (!seen) die("calloc");
+
+    for (uint64_t idx = 0; idx < size; idx++) {
+        if (seen[idx / 8] & (1 << (idx % 8))) continue;
+        if (idx / DIR_ENTRIES != loaded) {
+            loaded = idx / DIR_ENTRIES;
+            read_block(t, t->hdr.root_block + loaded, buf);
+        }
+
+        // the first entry of a bucket marks the others that point at it
+        uint64_t id = get64(buf, 8 * (idx % DIR_ENTRIES));
+        Bucket b;
+        read_bucket(t, id, &b);
+        for (uint64_t j = idx; j < size; j += 1ULL << b.depth) seen[j / 8] |= 1 << (j % 8);
+        fn(t, id, &b, ctx);
+    }
+    free(seen);
+}
+
+// scan callback and its context, passed through for_each_bucket
+typedef struct {
+    ScanFn fn;
+    void  *ctx;
+} ScanCtx;
+
+// helper to visit the pairs of a bucket
+static void scan_bucket(BTree *t, uint64_t id, const Bucket *b, void *ctx) {
+    ScanCtx *scan = ctx;
+    for (uint64_t i = 0; i < b->n; i++) scan->fn(scan->ctx, b->keys[i], b->values[i]);
+}
+
+void hash_scan(BTree *t, ScanFn fn, void *ctx) {
+    ScanCtx scan = { fn, ctx };
+    for_each_bucket(t, scan_bucket, &scan);
+}
+
+// helper to print a bucket
+static void print_bucket(BTree *t, uint64_t id, const Bucket *b, void *ctx) {
+    printf("Bucket[%llu] (depth=%llu, n=%llu):", (unsigned long long)id,
+           (unsigned long long)b->depth, (unsigned long long)b->n);
+    for (uint64_t i = 0; i < b->n; i++) {
+        printf(" (%llu,%llu)", (unsigned long long)b->keys[i], (unsigned long long)b->values[i]);
+    }
+    printf("\n");
+}
+
+void hash_print(BTree *t) {
+    for_each_bucket(t, print_bucket, NULL);
+}
@@ -0,0 +1,280 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Hot blocks and warm-up
+ *
+ * Every handle counts the reads of its blocks in a small table, one slot per
+ * hash of the block id. A read of the block in a slot adds one to its count,
+ * a read of another block takes one away, and an empty slot is taken by the
+ * next block that hashes to it. Blocks read on every lookup, such as the top
+ * levels of the tree, keep their slot, while blocks read once fade out.
+ *
+ * When the handle is closed, the most read blocks are recorded in the
+ * manifest <index>.hot, together with the counts already there, halved so
+ * old favourites fade out over a few sessions. A handle that is opened
+ * later starts a thread that reads the top WARM_LEVELS levels of the tree
+ * and then the blocks of the manifest, in block order so the reads are
+ * mostly sequential. Direct I/O handles load them into unused entries of
+ * their block cache, and other handles read them into the page cache. The
+ * handle serves requests meanwhile: the thread never evicts a block, and
+ * stops when the cache is full or the handle is closed.
+ *
+ * Manifest layout (all fields big-endian)
+ *   0  magic "4348HOT1"
+ *   8  number of blocks
+ *  16  block id and read count of each block, in block order
+ */
+#define HOT_MAGIC   "4348HOT1"
+
+// slots of the read counter table
+#define HOT_SLOT_BITS   12
+#define HOT_SLOTS       (1 << HOT_SLOT_BITS)
+
+// state of a warm-up thread, copied from the handle when it starts
+typedef struct {
+    BTree      *t;
+    int         fd;
+    BlockCache *cache;
+    uint64_t    root;
+    uint64_t    end;        // first block past the end of the file
+    uint64_t    flags;
+    int         max_keys;
+    char        path[4096];
+} WarmJob;
+
+// helper to build the path of the manifest
+static void hot_path(BTree *t, char *buf, size_t size) {
+    snprintf(buf, size, "%s.hot", t->path);
+}
+
+// helper to order slots by block id
+static int compare_ids(const void *a, const void *b) {
+    const HotSlot *x = a, *y = b;
+    return x->block_id < y->block_id ? -1 : x->block_id > y->block_id;
+}
+
+// helper to order slots by count, most read first
+static int compare_counts(const void *a, const void *b) {
+    const HotSlot *x = a, *y = b;
+    return x->count > y->count ? -1 : x->count < y->count;
+}
+
+// helper to read a manifest, returns the number of blocks (0 if there is none)
+static size_t load_manifest(const char *path, HotSlot **slots) {
+    *slots = NULL;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) return 0;
+
+    uint64_t hdr[2];
+    if (fread(hdr, sizeof(uint64_t), 2, file) != 2 || memcmp(hdr, HOT_MAGIC, 8) != 0 ||
+        be64_to_host(hdr[1]) > HOT_MAX_BLOCKS) {
+        fclose(file);
+        return 0;
+    }
+    size_t count = be64_to_host(hdr[1]);
+    HotSlot *list = malloc((count + 1) * sizeof(HotSlot));
+    if (!list) die("malloc");
+    if (fread(list, sizeof(HotSlot), count, file) != count) count = 0;
+    fclose(file);
+
+    for (size_t i = 0; i < count; i++) {
+        list[i].block_id = be64_to_host(list[i].block_id);
+        list[i].count = be64_to_host(list[i].count);
+    }
+    *slots = list;
+    return count;
+}
+
+void hot_open(BTree *t) {
+    t->hot = calloc(HOT_SLOTS, sizeof(HotSlot));
+    if (!t->hot) die("calloc");
+}
+
+void hot_note(BTree *t, uint64_t id) {
+    HotSlot *s = &t->hot[(id * 0x9e3779b97f4a7c15ULL) >> (64 - HOT_SLOT_BITS)];
+    if (s->block_id == id) {
+        s->count++;
+    } else if (s->count == 0) {
+        s->block_id = id;
+        s->count = 1;
+    } else {
+        s->count--;
+    }
+}
+
+void hot_close(BTree *t) {
+    if (!t->hot) return;
+
+    // the blocks this handle read, or nothing to record
+    HotSlot *list = malloc((HOT_SLOTS + HOT_MAX_BLOCKS) * sizeof(HotSlot));
+    if (!list) die("malloc");
+    size_t count = 0;
+    for (size_t i = 0; i < HOT_SLOTS; i++) {
+        if (t->hot[i].count > 0) list[count++] = t->hot[i];
+    }
+    free(t->hot);
+    t->hot = NULL;
+    if (count == 0) {
+        free(list);
+        return;
+    }
+
+    // add the earlier sessions at half weight, then sum up each block
+    char path[4096];
+    hot_path(t, path, sizeof(path));
+    HotSlot *old;
+    size_t old_count = load_manifest(path, &old);
+    for (size_t i = 0; i < old_count; i++) {
+        if (old[i].count / 2 == 0) continue;
+        list[count] = old[i];
+        list[count++].count /= 2;
+    }
+    free(old);
+    qsort(list, count, sizeof(HotSlot), compare_ids);
+    size_t merged = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (merged > 0 && list[merged - 1].block_id == list[i].block_id) {
+            list[merged - 1].count += list[i].count;
+        } else {
+            list[merged++] = list[i];
+        }
+    }
+
+    // keep the most read blocks, in block order
+    qsort(list, merged, sizeof(HotSlot), compare_counts);
+    if (merged > HOT_MAX_BLOCKS) merged = HOT_MAX_BLOCKS;
+    qsort(list, merged, sizeof(HotSlot), compare_ids);
+
+    // every process that closes the index saves, so each uses its own file
+    // and renames it over the manifest
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int)getpid());
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        free(list);
+        return;
+    }
+    uint64_t hdr[2];
+    memcpy(hdr, HOT_MAGIC, 8);
+    hdr[1] = host_to_be64(merged);
+    for (size_t i = 0; i < merged; i++) {
+        list[i].block_id = host_to_be64(list[i].block_id);
+        list[i].count = host_to_be64(list[i].count);
+    }
+    int ok = fwrite(hdr, sizeof(uint64_t), 2, file) == 2 &&
+             fwrite(list, sizeof(HotSlot), merged, file) == merged;
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp, path) != 0) remove(tmp);
+    free(list);
+}
+
+// helper to check that a block id from a manifest or node is in the file
+static int in_file(WarmJob *job, uint64_t id) {
+    return id != 0 && id < job->end;
+}
+
+// helper to read one block ahead of its use, returns 1 to go on, 0 to stop
+static int warm_block(WarmJob *job, uint64_t id, void *buf) {
+    if (__atomic_load_n(&job->t->warm_stop, __ATOMIC_ACQUIRE)) return 0;
+
+    // direct I/O handles fill their cache, others the kernel page cache
+    if (job->cache) return cache_load(job->cache, job->fd, id, buf) == 1;
+    return io_read_node(job->fd, id, buf) == 0;
+}
+
+// helper to warm up the top levels of the tree, returns 1 to go on
+static int warm_levels(WarmJob *job, uint8_t *buf) {
+    // hash indexes start with their directory and snapshots with their
+    // pages, neither is a tree
+    if (job->flags & (BT_FLAG_HASH | BT_FLAG_FROZEN)) return 1;
+
+    uint64_t *level = malloc(sizeof(uint64_t));
+    if (!level) die("malloc");
+    level[0] = job->root;
+    size_t count = 1;
+    int go_on = 1;
+    for (int depth = 0; depth < WARM_LEVELS && count > 0 && go_on; depth++) {
+        // the next level is collected while this one is read, in block order
+        uint64_t *next = malloc(count * MAX_CHILDREN * sizeof(uint64_t));
+        if (!next) die("malloc");
+        size_t next_count = 0;
+        for (size_t i = 0; i < count && go_on; i++) {
+            go_on = warm_block(job, level[i], buf);
+            if (!go_on || depth + 1 == WARM_LEVELS) continue;
+
+            // a block rewritten meanwhile may hold anything, so only ids
+            // inside the file are followed
+            uint64_t children[MAX_CHILDREN];
+            int n = block_children(buf, job->flags, job->max_keys, children);
+            for (int j = 0; j < n; j++) {
+                if (in_file(job, children[j])) next[next_count++] = children[j];
+            }
+        }
+        qsort(next, next_count, sizeof(uint64_t), compare_keys);
+        free(level);
+        level = next;
+        count = next_count;
+    }
+    free(level);
+    return go_on;
+}
+
+// warm-up thread
+static void *warm_run(void *arg) {
+    WarmJob *job = arg;
+    uint8_t *buf = io_alloc(BLOCK_SIZE);
+    if (!buf) die("malloc");
+
+    // every lookup reads the top levels, then the blocks earlier sessions
+    // read most, which the manifest lists in block order
+    if (warm_levels(job, buf)) {
+        HotSlot *list;
+        size_t count = load_manifest(job->path, &list);
+        for (size_t i = 0; i < count; i++) {
+            if (in_file(job, list[i].block_id) && !warm_block(job, list[i].block_id, buf)) break;
+        }
+        free(list);
+    }
+
+    io_free(buf, BLOCK_SIZE);
+    free(job);
+    return NULL;
+}
+
+void warm_start(BTree *t) {
+    // snapshots keep no manifest and have no levels to read
+    if (t->hdr.flags & BT_FLAG_FROZEN) return;
+
+    WarmJob *job = calloc(1, sizeof(*job));
+    if (!job) die("calloc");
+    job->t = t;
+    job->fd = t->fd;
+    job->cache = t->cache;
+    job->root = t->hdr.root_block;
+    job->end = t->hdr.next_free_block;
+    job->flags = t->hdr.flags;
+    job->max_keys = t->max_keys;
+    hot_path(t, job->path, sizeof(job->path));
+
+    // the index works without a warm-up, so a failure is not an error
+    t->warm_stop = 0;
+    if (pthread_create(&t->warm_thread, NULL, warm_run, job) != 0) {
+        free(job);
+        return;
+    }
+    t->warming = 1;
+}
+
+void warm_stop(BTree *t) {
+    if (!t->warming) return;
+    __atomic_store_n(&t->warm_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(t->warm_thread, NULL);
+    t->warming = 0;
+}
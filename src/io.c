@@ -1,7 +1,20 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdint.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+// linux/fs.h (pulled in above) has its own BLOCK_SIZE, ours is in constants.h
+#undef BLOCK_SIZE
+#endif
 
 #include "constants.h"
 #include "utils.h"
@@ -22,14 +35,78 @@ void io_close(int fd) {
     close(fd);
 }
 
-int io_read_header(int fd, BTHeader *header) {
-    // create buffer of size BLOCK_SIZE
-    uint8_t buf[BLOCK_SIZE];
-    // read header into buffer
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, 0);
-    if (n != BLOCK_SIZE) return -1;
-    
-    // parse header
+int io_set_direct(int fd) {
+#ifdef O_DIRECT
+    // file systems without direct I/O reject the flag
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_DIRECT) < 0) return -1;
+
+    // blocks must start and end on the device's sector boundaries
+    unsigned align = 512;
+#ifdef STATX_DIOALIGN
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+        align = stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align
+                                                                  : stx.stx_dio_mem_align;
+    }
+#endif
+    if (align == 0 || BLOCK_SIZE % align != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+#else
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/**
+ * Aligned buffer pool
+ */
+
+// largest buffer (in blocks) kept for reuse, bigger ones go back to libc
+#define POOL_MAX_BLOCKS 32
+
+// free buffers by size in blocks; a free buffer stores the next pointer
+static void *pool_free[POOL_MAX_BLOCKS + 1];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void *io_alloc(size_t size) {
+    size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks == 0) blocks = 1;
+
+    // reuse a buffer of the same size if one is free
+    void *buf = NULL;
+    if (blocks <= POOL_MAX_BLOCKS) {
+        pthread_mutex_lock(&pool_lock);
+        buf = pool_free[blocks];
+        if (buf) pool_free[blocks] = *(void **)buf;
+        pthread_mutex_unlock(&pool_lock);
+        if (buf) return buf;
+    }
+
+    if (posix_memalign(&buf, BLOCK_SIZE, blocks * BLOCK_SIZE) != 0) return NULL;
+    return buf;
+}
+
+void io_free(void *buf, size_t size) {
+    if (!buf) return;
+    size_t blocks = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (blocks == 0) blocks = 1;
+    if (blocks > POOL_MAX_BLOCKS) {
+        free(buf);
+        return;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    *(void **)buf = pool_free[blocks];
+    pool_free[blocks] = buf;
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// helper to parse a header block
+static void decode_header(const uint8_t *buf, BTHeader *header) {
     uint64_t temp;
     // magic
     memcpy(&temp, buf, sizeof(temp));
@@ -40,12 +117,63 @@ int io_read_header(int fd, BTHeader *header) {
     // next free block
     memcpy(&temp, buf + 16, sizeof(temp));
     header->next_free_block = be64_to_host(temp);
+    // flags
+    memcpy(&temp, buf + 24, sizeof(temp));
+    header->flags = be64_to_host(temp);
+    // generation
+    memcpy(&temp, buf + 32, sizeof(temp));
+    header->generation = be64_to_host(temp);
+    // free list head
+    memcpy(&temp, buf + 40, sizeof(temp));
+    header->free_head = be64_to_host(temp);
+    // bloom filter bits per key
+    memcpy(&temp, buf + 48, sizeof(temp));
+    header->bloom_bits = be64_to_host(temp);
+    // shard count
+    memcpy(&temp, buf + 56, sizeof(temp));
+    header->shard_count = be64_to_host(temp);
+    // typed node layout
+    memcpy(&temp, buf + 64, sizeof(temp));
+    header->layout = be64_to_host(temp);
+    // block cache size of direct I/O handles
+    memcpy(&temp, buf + 72, sizeof(temp));
+    header->cache_blocks = be64_to_host(temp);
+    // directory depth of hash indexes
+    memcpy(&temp, buf + 80, sizeof(temp));
+    header->hash_depth = be64_to_host(temp);
+    // changes published to other processes
+    memcpy(&temp, buf + 88, sizeof(temp));
+    header->changes = be64_to_host(temp);
+}
 
+int io_read_header(int fd, BTHeader *header) {
+    // create buffer of size BLOCK_SIZE
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
+    // read header into buffer
+    ssize_t n = pread(fd, buf, BLOCK_SIZE, 0);
+    if (n != BLOCK_SIZE) return -1;
+
+    // parse header
+    decode_header(buf, header);
     return 0;
 }
 
+const void *io_map_header(int fd) {
+    // a shared read-only mapping follows every write to the block
+    void *map = mmap(NULL, BLOCK_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+    return map == MAP_FAILED ? NULL : map;
+}
+
+void io_unmap_header(const void *map) {
+    if (map) munmap((void *)map, BLOCK_SIZE);
+}
+
+void io_load_header(const void *map, BTHeader *header) {
+    decode_header(map, header);
+}
+
 int io_write_header(int fd, const BTHeader *header) {
-    uint8_t buf[BLOCK_SIZE];
+    uint8_t buf[BLOCK_SIZE] IO_ALIGNED;
     memset(buf, 0, BLOCK_SIZE);
 
     // store header
@@ -58,6 +186,33 @@ int io_write_header(int fd, const BTHeader *header) {
     // next free block
     temp = host_to_be64(header->next_free_block);
     memcpy(buf + 16, &temp, sizeof(temp));
+    // flags
+    temp = host_to_be64(header->flags);
+    memcpy(buf + 24, &temp, sizeof(temp));
+    // generation
+    temp = host_to_be64(header->generation);
+    memcpy(buf + 32, &temp, sizeof(temp));
+    // free list head
+    temp = host_to_be64(header->free_head);
+    memcpy(buf + 40, &temp, sizeof(temp));
+    // bloom filter bits per key
+    temp = host_to_be64(header->bloom_bits);
+    memcpy(buf + 48, &temp, sizeof(temp));
+    // shard count
+    temp = host_to_be64(header->shard_count);
+    memcpy(buf + 56, &temp, sizeof(temp));
+    // typed node layout
+    temp = host_to_be64(header->layout);
+    memcpy(buf + 64, &temp, sizeof(temp));
+    // block cache size of direct I/O handles
+    temp = host_to_be64(header->cache_blocks);
+    memcpy(buf + 72, &temp, sizeof(temp));
+    // directory depth of hash indexes
+    temp = host_to_be64(header->hash_depth);
+    memcpy(buf + 80, &temp, sizeof(temp));
+    // changes published to other processes
+    temp = host_to_be64(header->changes);
+    memcpy(buf + 88, &temp, sizeof(temp));
 
     // write to file
     ssize_t n = pwrite(fd, buf, BLOCK_SIZE, 0);
@@ -65,17 +220,291 @@ int io_write_header(int fd, const BTHeader *header) {
 }
 
 int io_read_node(int fd, uint64_t block_id, void *buf) {
-    // calculate offset
-    off_t offset = block_id * BLOCK_SIZE;
-    // read node into buffer
-    ssize_t n = pread(fd, buf, BLOCK_SIZE, offset);
-    return (n == BLOCK_SIZE) ? 0 : -1;
+    return io_read_block(fd, block_id, buf, BLOCK_SIZE);
 }
 
 int io_write_node(int fd, uint64_t block_id, const void *buf) {
+    return io_write_block(fd, block_id, buf, BLOCK_SIZE);
+}
+
+int io_read_block(int fd, uint64_t block_id, void *buf, size_t size) {
     // calculate offset
-    off_t offset = block_id * BLOCK_SIZE;
-    // write node to file
-    ssize_t n = pwrite(fd, buf, BLOCK_SIZE, offset);
-    return (n == BLOCK_SIZE) ? 0 : -1;
+    off_t offset = block_id * size;
+    // read block into buffer
+    ssize_t n = pread(fd, buf, size, offset);
+    return (n == (ssize_t)size) ? 0 : -1;
+}
+
+int io_write_block(int fd, uint64_t block_id, const void *buf, size_t size) {
+    // calculate offset
+    off_t offset = block_id * size;
+    // write block to file
+    ssize_t n = pwrite(fd, buf, size, offset);
+    return (n == (ssize_t)size) ? 0 : -1;
+}
+
+// open file description locks follow the fd instead of the process, so two
+// handles in one process do not share (or silently drop) each other's locks
+#ifdef F_OFD_SETLK
+#define LOCK_SET  F_OFD_SETLK
+#define LOCK_WAIT F_OFD_SETLKW
+#define LOCK_GET  F_OFD_GETLK
+#else
+#define LOCK_SET  F_SETLK
+#define LOCK_WAIT F_SETLKW
+#define LOCK_GET  F_GETLK
+#endif
+
+int io_lock(int fd, int type, uint64_t start, uint64_t len, int wait) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    return fcntl(fd, wait ? LOCK_WAIT : LOCK_SET, &fl);
+}
+
+int io_lock_held(int fd, uint64_t start, uint64_t len) {
+    struct flock fl;
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = start;
+    fl.l_len = len;
+    if (fcntl(fd, LOCK_GET, &fl) < 0) return -1;
+    return fl.l_type != F_UNLCK;
+}
+
+
+/**
+ * io_uring backend (raw syscalls, no liburing)
+ */
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define HAVE_IO_URING 1
+#endif
+
+// number of submission queue entries per ring
+#define RING_ENTRIES 64
+
+#ifdef HAVE_IO_URING
+// per-thread ring state
+typedef struct {
+    int      state;      // 0 = not set up yet, 1 = ready, -1 = unavailable
+    int      ring_fd;    // io_uring file descriptor
+    unsigned entries;    // number of sq entries
+    unsigned inflight;   // submitted but not yet reaped requests
+    void    *sq_ptr;     // mapped sq ring
+    size_t   sq_size;
+    void    *cq_ptr;     // mapped cq ring (may alias sq_ptr)
+    size_t   cq_size;
+    struct io_uring_sqe *sqes;
+    size_t   sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+} Ring;
+
+static __thread Ring ring;
+
+// helper to check that the kernel runs the opcodes we queue: io_uring_setup
+// works from 5.1, but IORING_OP_READ/WRITE (and the probe itself) came in 5.6
+static int ring_probe(int fd) {
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, size);
+    if (!probe) return 0;
+    int ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0 &&
+             probe->last_op >= IORING_OP_WRITE &&
+             (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+             (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+// helper to set up the ring on first use
+static int ring_init(void) {
+    if (ring.state != 0) return ring.state;
+    ring.state = -1;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if (fd < 0) return -1;
+
+    // older kernels would fail every request, so use blocking calls there
+    if (!ring_probe(fd)) {
+        close(fd);
+        return -1;
+    }
+
+    // map the submission and completion rings
+    ring.sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+        ring.cq_size = ring.sq_size;
+    }
+    ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ|PROT_WRITE,
+                           MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            munmap(ring.sq_ptr, ring.sq_size);
+            close(fd);
+            return -1;
+        }
+    }
+    // map the submission queue entries
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        if (ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+        munmap(ring.sq_ptr, ring.sq_size);
+        close(fd);
+        return -1;
+    }
+
+    // resolve ring offsets
+    uint8_t *sq = ring.sq_ptr;
+    uint8_t *cq = ring.cq_ptr;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    ring.ring_fd = fd;
+    ring.entries = p.sq_entries;
+    ring.inflight = 0;
+    ring.state = 1;
+    return 1;
+}
+
+// helper to enter the kernel (submit and/or wait for completions)
+static int ring_enter(unsigned to_submit, unsigned min_complete) {
+    unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+    return syscall(__NR_io_uring_enter, ring.ring_fd, to_submit, min_complete,
+                   flags, NULL, 0);
+}
+
+// helper to drain the completion queue, returns number of reaped entries
+static int ring_reap(void) {
+    int reaped = 0;
+    unsigned head = *ring.cq_head;
+    while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        IoRequest *req = (IoRequest *)(uintptr_t)cqe->user_data;
+        req->result = (cqe->res == BLOCK_SIZE) ? 0 : -1;
+        req->done = 1;
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    ring.inflight -= reaped;
+    return reaped;
+}
+
+// helper to block until at least one completion is available
+static int ring_wait_one(void) {
+    while (ring_reap() == 0) {
+        if (ring_enter(0, 1) < 0) return -1;
+    }
+    return 0;
+}
+#endif
+
+// helper to perform a request synchronously
+static void sync_request(int fd, IoRequest *req) {
+    req->result = req->write ? io_write_node(fd, req->block_id, req->buf)
+                             : io_read_node(fd, req->block_id, req->buf);
+    req->done = 1;
+}
+
+int io_batch_submit(int fd, IoRequest *reqs, int count) {
+    for (int i = 0; i < count; i++) reqs[i].done = 0;
+
+#ifdef HAVE_IO_URING
+    if (ring_init() == 1) {
+        int i = 0;
+        while (i < count) {
+            // queue as many requests as the ring can hold
+            unsigned tail = *ring.sq_tail;
+            unsigned queued = 0;
+            while (i < count && ring.inflight + queued < ring.entries) {
+                unsigned idx = tail & *ring.sq_mask;
+                struct io_uring_sqe *sqe = &ring.sqes[idx];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->opcode = reqs[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+                sqe->fd = fd;
+                sqe->off = reqs[i].block_id * BLOCK_SIZE;
+                sqe->addr = (uintptr_t)reqs[i].buf;
+                sqe->len = BLOCK_SIZE;
+                sqe->user_data = (uintptr_t)&reqs[i];
+                ring.sq_array[idx] = idx;
+                tail++;
+                queued++;
+                i++;
+            }
+            __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+            // hand the new entries to the kernel
+            while (queued > 0) {
+                int n = ring_enter(queued, 0);
+                if (n < 0) return -1;
+                queued -= n;
+                ring.inflight += n;
+            }
+
+            // ring is full, make room before queueing more
+            if (i < count && ring_wait_one() < 0) return -1;
+        }
+        return 0;
+    }
+#endif
+
+    // no io_uring, fall back to one blocking call per block
+    for (int i = 0; i < count; i++) sync_request(fd, &reqs[i]);
+    return 0;
+}
+
+int io_batch_wait(IoRequest *req) {
+#ifdef HAVE_IO_URING
+    while (!req->done) {
+        if (ring.state != 1 || ring_wait_one() < 0) return -1;
+    }
+#endif
+    return req->result;
+}
+
+int io_batch_wait_all(IoRequest *reqs, int count) {
+    int result = 0;
+    for (int i = 0; i < count; i++) {
+        if (io_batch_wait(&reqs[i]) < 0) result = -1;
+    }
+    return result;
+}
+
+void io_batch_shutdown(void) {
+#ifdef HAVE_IO_URING
+    if (ring.state != 1) return;
+    // reap anything still in flight before tearing down
+    while (ring.inflight > 0 && ring_wait_one() == 0);
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != ring.sq_ptr) munmap(ring.cq_ptr, ring.cq_size);
+    munmap(ring.sq_ptr, ring.sq_size);
+    close(ring.ring_fd);
+    ring.state = 0;
+#endif
 }
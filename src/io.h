@@ -6,10 +6,30 @@
 
 #include "constants.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 /**
  * Functions for managing index files
  */
 
+/**
+ * Alignment of buffers passed to block I/O, so they also work with O_DIRECT
+ */
+#define IO_ALIGNED __attribute__((aligned(BLOCK_SIZE)))
+
+/**
+ * Asynchronous block request used by the batched I/O functions
+ */
+typedef struct {
+    uint64_t block_id;  // block to read or write
+    void    *buf;       // buffer of BLOCK_SIZE bytes
+    int      write;     // 1 to write the block, 0 to read it
+    int      done;      // set to 1 once the request has completed
+    int      result;    // 0 on success, -1 on error (valid once done)
+} IoRequest;
+
 /**
  * Check if a file exists
  * @param filename  Path to the file
@@ -25,6 +45,30 @@ int io_file_exists(const char *filename);
  */
 int io_open(const char *filename, int flags);
 
+/**
+ * Switch an open index file to direct I/O (O_DIRECT), bypassing the page
+ * cache. Every later transfer must use IO_ALIGNED or io_alloc buffers.
+ * @param fd        File descriptor
+ * @return          0 on success, -1 if the file system does not support it
+ *                  or BLOCK_SIZE is not a multiple of the device sector
+ */
+int io_set_direct(int fd);
+
+/**
+ * Allocate a buffer aligned for direct I/O. Small buffers are recycled
+ * through a pool shared by all threads.
+ * @param size      Size in bytes (rounded up to whole blocks)
+ * @return          Buffer aligned to BLOCK_SIZE, or NULL on error
+ */
+void *io_alloc(size_t size);
+
+/**
+ * Return a buffer to the pool
+ * @param buf       Buffer from io_alloc (may be NULL)
+ * @param size      Size passed to io_alloc
+ */
+void io_free(void *buf, size_t size);
+
 /**
  * Close an index file
  * @param fd        File descriptor
@@ -45,6 +89,27 @@ int io_read_header(int fd, BTHeader *header);
  */
 int io_write_header(int fd, const BTHeader *header);
 
+/**
+ * Map the header block of an index file, so writes by any process show up
+ * without reading the file again
+ * @param fd        File descriptor
+ * @return          Read-only mapping of BLOCK_SIZE bytes, or NULL on error
+ */
+const void *io_map_header(int fd);
+
+/**
+ * Unmap a header mapping
+ * @param map       Mapping from io_map_header (may be NULL)
+ */
+void io_unmap_header(const void *map);
+
+/**
+ * Parse the header from a header mapping
+ * @param map       Mapping from io_map_header
+ * @param header    Pointer to the header structure
+ */
+void io_load_header(const void *map, BTHeader *header);
+
 /**
  * Read a node from an index file
  * @param fd        File descriptor
@@ -61,4 +126,79 @@ int io_read_node(int fd, uint64_t block_id, void *buf);
  */
 int io_write_node(int fd, uint64_t block_id, const void *buf);
 
+/**
+ * Read a block of any size from an index file (block i starts at i * size)
+ * @param fd        File descriptor
+ * @param block_id  Block ID
+ * @param buf       Pointer to the buffer to read the block into
+ * @param size      Block size in bytes
+ */
+int io_read_block(int fd, uint64_t block_id, void *buf, size_t size);
+
+/**
+ * Write a block of any size to an index file (block i starts at i * size)
+ * @param fd        File descriptor
+ * @param block_id  Block ID
+ * @param buf       Pointer to the buffer to write the block from
+ * @param size      Block size in bytes
+ */
+int io_write_block(int fd, uint64_t block_id, const void *buf, size_t size);
+
+/**
+ * Take or release an advisory lock on a byte range of an index file.
+ * The range may lie past the end of the file.
+ * @param fd        File descriptor
+ * @param type      F_RDLCK, F_WRLCK or F_UNLCK
+ * @param start     First byte of the range
+ * @param len       Length of the range
+ * @param wait      1 to block until the lock is granted, 0 to fail instead
+ * @return          0 on success, -1 on error
+ */
+int io_lock(int fd, int type, uint64_t start, uint64_t len, int wait);
+
+/**
+ * Check whether any other open file holds a lock in a byte range
+ * @param fd        File descriptor
+ * @param start     First byte of the range
+ * @param len       Length of the range
+ * @return          1 if a lock is held, 0 if not, -1 on error
+ */
+int io_lock_held(int fd, uint64_t start, uint64_t len);
+
+/**
+ * Submit a batch of block reads/writes without waiting for them.
+ * Uses io_uring when the kernel supports it, otherwise the requests are
+ * performed synchronously before returning. The requests and their
+ * buffers must stay valid until they are completed.
+ * @param fd        File descriptor
+ * @param reqs      Array of requests
+ * @param count     Number of requests
+ * @return          0 on success, -1 on error
+ */
+int io_batch_submit(int fd, IoRequest *reqs, int count);
+
+/**
+ * Wait for a single submitted request to complete
+ * @param req       Request previously passed to io_batch_submit
+ * @return          The request result (0 on success, -1 on error)
+ */
+int io_batch_wait(IoRequest *req);
+
+/**
+ * Wait for every request of a batch to complete
+ * @param reqs      Array of requests
+ * @param count     Number of requests
+ * @return          0 if all requests succeeded, -1 otherwise
+ */
+int io_batch_wait_all(IoRequest *reqs, int count);
+
+/**
+ * Release the calling thread's io_uring instance (if any)
+ */
+void io_batch_shutdown(void);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /* IO_H */
@@ -0,0 +1,148 @@
+#include <fcntl.h>
+#include <stdio.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Multi-process locking
+ *
+ * Any number of processes may open an index, but only one handle at a time
+ * writes it. The first write through a handle takes the writer lock, an
+ * advisory lock on a byte far past the end of the file, and keeps it until
+ * the handle is closed; a handle that wants to write while another one holds
+ * it waits for that handle to close.
+ *
+ * Readers and the writer share a second lock byte, the tree lock. Every
+ * operation of an in-place index holds it for its own duration: shared for
+ * lookups and scans, exclusive for a change. A reader therefore waits for at
+ * most one change of the writer, and never sees a tree in the middle of a
+ * split. Copy-on-write indexes need no tree lock: writers never touch a
+ * published block, so a reader only moves its snapshot pin to the newest
+ * generation when it starts an operation.
+ *
+ * The header block is mapped into every handle. The writer publishes each
+ * change by writing the header with a bumped change count, and a reader
+ * compares the mapped counts with its own copy when it starts an operation.
+ * Only when they differ does it take the new header over and drop what it
+ * cached about the old tree. Only the writer ever writes the header, so
+ * closing a reader leaves the file as it is.
+ */
+
+// lock bytes, below the snapshot pins of copy-on-write files (see cow.c)
+#define WRITER_LOCK ((uint64_t)1 << 47)
+#define TREE_LOCK   (WRITER_LOCK + 1)
+
+// helper to drop what the handle knows about the tree it saw before
+static void forget_tree(BTree *t, int new_generation) {
+    // cached blocks and the cached right edge may have been rewritten
+    if (t->cache) cache_clear(t->cache);
+    append_forget(t);
+
+    // the filter is only trusted if it was saved for this exact generation
+    if ((t->hdr.flags & BT_FLAG_BLOOM) && (new_generation || !t->bloom)) {
+        char bloom_path[4096];
+        snprintf(bloom_path, sizeof(bloom_path), "%s.bloom", t->path);
+        bloom_free(t->bloom);
+        t->bloom = bloom_load(bloom_path, t->hdr.generation);
+    }
+
+    // the writer builds the secondary before it enables it
+    if ((t->hdr.flags & BT_FLAG_VALUES) && !t->vindex) vindex_open(t);
+}
+
+// helper to pick up the header published by the writer, returns 1 if it
+// changed
+static int refresh(BTree *t) {
+    BTHeader hdr;
+    lock_read_header(t, &hdr);
+    if (hdr.generation == t->hdr.generation && hdr.changes == t->hdr.changes) return 0;
+    int new_generation = hdr.generation != t->hdr.generation;
+    t->hdr = hdr;
+    forget_tree(t, new_generation);
+    return 1;
+}
+
+void lock_read_header(BTree *t, BTHeader *hdr) {
+    BTHeader again;
+    if (t->hdr_map) io_load_header(t->hdr_map, hdr);
+    else if (io_read_header(t->fd, hdr) < 0) die("io_read_header");
+    while (1) {
+        if (t->hdr_map) io_load_header(t->hdr_map, &again);
+        else if (io_read_header(t->fd, &again) < 0) die("io_read_header");
+
+        // a copy taken while the writer rewrites the block can mix two commits
+        if (again.generation == hdr->generation && again.root_block == hdr->root_block) return;
+        *hdr = again;
+    }
+}
+
+void lock_open(BTree *t) {
+    t->hdr_map = io_map_header(t->fd);
+    if (!t->hdr_map) die("io_map_header");
+}
+
+void lock_close(BTree *t) {
+    io_unmap_header(t->hdr_map);
+    t->hdr_map = NULL;
+}
+
+void lock_write(BTree *t) {
+    if (t->writer || !t->hdr_map) return;
+
+    // waiting here while holding the tree lock could wait forever
+    if (t->op_depth > 0 && !t->op_write) die("write during a read operation");
+
+    if (io_lock(t->fd, F_WRLCK, WRITER_LOCK, 1, 1) < 0) die("io_lock");
+    t->writer = 1;
+
+    // continue from the tree the previous writer left
+    refresh(t);
+    if (t->hdr.flags & BT_FLAG_COW) cow_pin_snapshot(t);
+}
+
+void lock_enter(BTree *t, int write) {
+    if (!t->hdr_map) return;
+    if (t->op_depth++ > 0) {
+        if (write && !t->op_write) die("write during a read operation");
+        return;
+    }
+    t->op_write = write;
+    if (write) lock_write(t);
+
+    // copy-on-write readers move to the newest snapshot between operations
+    if (t->hdr.flags & BT_FLAG_COW) {
+        if (!t->writer && refresh(t) && cow_pin_snapshot(t)) forget_tree(t, 1);
+        return;
+    }
+
+    if (io_lock(t->fd, write ? F_WRLCK : F_RDLCK, TREE_LOCK, 1, 1) < 0) die("io_lock");
+    if (!t->writer) refresh(t);
+}
+
+void lock_leave(BTree *t) {
+    if (!t->hdr_map || --t->op_depth > 0) return;
+    if (t->hdr.flags & BT_FLAG_COW) return;
+
+    // readers see the change as soon as they can take the tree lock
+    if (t->unpublished && lock_publish(t) < 0) die("io_write_header");
+    io_lock(t->fd, F_UNLCK, TREE_LOCK, 1, 0);
+}
+
+uint64_t lock_watermark(BTree *t) {
+    uint64_t gen = t->hdr.generation;
+
+    // copy-on-write writers publish a new generation with every insert
+    if ((t->hdr.flags & BT_FLAG_COW) || gen == 0) return gen;
+
+    // an open writer session writes the current generation until it closes
+    if (t->dirty || (t->hdr_map && !t->writer && io_lock_held(t->fd, WRITER_LOCK, 1) != 0)) return gen - 1;
+    return gen;
+}
+
+int lock_publish(BTree *t) {
+    t->hdr.changes++;
+    t->unpublished = 0;
+    return io_write_header(t->fd, &t->hdr);
+}
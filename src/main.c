@@ -14,7 +14,7 @@ int main(int argc, char *argv[]) {
     // check if the call includes a command and index file
     if (argc < 3) {
         fprintf(stderr, "Usage: ./main <command> <index_file> [arguments]\n");
-        fprintf(stderr, "Valid commands: create, insert, search, load, print, extract\n");
+        fprintf(stderr, "Valid commands: create, insert, upsert, search, load, print, extract, bloom, count, rank, select, freeze, merge, search-value, vindex\n");
         exit(EXIT_FAILURE);
     }
 
@@ -22,19 +22,74 @@ int main(int argc, char *argv[]) {
     const char *index_file_path = argv[2];
 
     if (strcmp(command, "create") == 0) {
-        // check if create is called with extra arguments
-        if (argc != 3) {
-            fprintf(stderr, "Usage: ./main create <index_file>\n");
+        // parse the index mode options
+        uint64_t flags = 0;
+        uint64_t bloom_bits = 0;
+        uint64_t cache_blocks = 0;
+        uint64_t shard_count = 0;
+        for (int i = 3; i < argc; i++) {
+            if (strcmp(argv[i], "--cow") == 0) {
+                flags |= BT_FLAG_COW;
+            } else if (strncmp(argv[i], "--shards=", 9) == 0) {
+                shard_count = strtoull(argv[i] + 9, NULL, 10);
+            } else if (strcmp(argv[i], "--counted") == 0) {
+                flags |= BT_FLAG_COUNTED;
+            } else if (strcmp(argv[i], "--buffered") == 0) {
+                flags |= BT_FLAG_BUFFERED;
+            } else if (strcmp(argv[i], "--hash") == 0) {
+                flags |= BT_FLAG_HASH;
+            } else if (strcmp(argv[i], "--bloom") == 0) {
+                flags |= BT_FLAG_BLOOM;
+            } else if (strncmp(argv[i], "--bloom=", 8) == 0) {
+                flags |= BT_FLAG_BLOOM;
+                bloom_bits = strtoull(argv[i] + 8, NULL, 10);
+            } else if (strcmp(argv[i], "--values") == 0) {
+                flags |= BT_FLAG_VALUES;
+            } else if (strcmp(argv[i], "--direct") == 0) {
+                flags |= BT_FLAG_DIRECT;
+            } else if (strncmp(argv[i], "--direct=", 9) == 0) {
+                flags |= BT_FLAG_DIRECT;
+                cache_blocks = strtoull(argv[i] + 9, NULL, 10);
+            } else {
+                fprintf(stderr, "Usage: ./main create <index_file> [--cow | --counted | --buffered | --hash] [--bloom[=<bits_per_key>]] [--values] [--direct[=<cache_blocks>]] [--shards=<n>]\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // buffered nodes have no room for subtree counts, and shadow paging
+        // would copy the buffers on every write
+        if ((flags & BT_FLAG_BUFFERED) && (flags & (BT_FLAG_COW | BT_FLAG_COUNTED))) {
+            fprintf(stderr, "Error: --buffered cannot be combined with --cow or --counted\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // the hash engine has its own block formats and no key order
+        if ((flags & BT_FLAG_HASH) && (flags & (BT_FLAG_COW | BT_FLAG_COUNTED | BT_FLAG_BUFFERED))) {
+            fprintf(stderr, "Error: --hash cannot be combined with --cow, --counted or --buffered\n");
             exit(EXIT_FAILURE);
         }
 
         // create index file
-        BTree *tree = bt_create(index_file_path);
+        BTree *tree = bt_create_sharded(index_file_path, flags, shard_count);
         if (tree == NULL) {
             fprintf(stderr, "Error: Failed to create index file\n");
             exit(EXIT_FAILURE);
         }
 
+        // apply a non-default filter size
+        if (bloom_bits != 0 && bt_enable_bloom(tree, bloom_bits) != SUCCESS) {
+            fprintf(stderr, "Error: Failed to create bloom filter\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // apply a non-default cache size
+        if (cache_blocks != 0 && bt_set_cache_size(tree, cache_blocks) != SUCCESS) {
+            fprintf(stderr, "Error: Failed to size block cache\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
         // print success message
         printf("index file created successfully\n");
         // close index file
@@ -71,6 +126,37 @@ int main(int argc, char *argv[]) {
         // close the b-tree
         bt_close(tree);
     }
+    else if (strcmp(command, "upsert") == 0) {
+        // check if upsert is called with extra arguments
+        if (argc != 5) {
+            fprintf(stderr, "Usage: ./main upsert <index_file> <key> <value>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // convert the key and value to uint64_t
+        uint64_t key = strtoull(argv[3], NULL, 10);
+        uint64_t value = strtoull(argv[4], NULL, 10);
+
+        // replace the value of the key, or insert it
+        int result = bt_upsert(tree, key, value);
+        if (result != SUCCESS) {
+            fprintf(stderr, "Error: Failed to upsert data into b-tree\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print success message
+        printf("data upserted into b-tree\n");
+        // close the b-tree
+        bt_close(tree);
+    }
     else if (strcmp(command, "search") == 0) {
         if (argc != 4) {
             fprintf(stderr, "Usage: ./main search <index_file> <key>\n");
@@ -105,6 +191,42 @@ int main(int argc, char *argv[]) {
         // close the b-tree
         bt_close(tree);
     }
+    else if (strcmp(command, "search-value") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: ./main search-value <index_file> <value>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // look the value up in the secondary index
+        uint64_t value = strtoull(argv[3], NULL, 10);
+        uint64_t *keys = NULL;
+        size_t count = 0;
+        int result = bt_search_value(tree, value, &keys, &count);
+        if (result == ERROR_KEY_NOT_FOUND) {
+            printf("value not found in b-tree\n");
+            free(keys);
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        } else if (result == ERROR_UNSUPPORTED) {
+            fprintf(stderr, "Error: index has no value index (see the vindex command)\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print every key stored with the value
+        printf("value found in b-tree with %zu keys\n", count);
+        for (size_t i = 0; i < count; i++) printf("key %llu\n", (unsigned long long)keys[i]);
+        free(keys);
+        // close the b-tree
+        bt_close(tree);
+    }
     else if (strcmp(command, "load") == 0) {
         // check if load is called with extra arguments
         if (argc != 4) {
@@ -152,8 +274,13 @@ int main(int argc, char *argv[]) {
         bt_close(tree);
     }
     else if (strcmp(command, "extract") == 0) {
-        if (argc != 4) {
-            fprintf(stderr, "Usage: ./main extract <index_file> <csv_file>\n");
+        int since_given = 0;
+        uint64_t since = 0;
+        if (argc == 6 && strcmp(argv[4], "--since") == 0) {
+            since_given = 1;
+            since = strtoull(argv[5], NULL, 10);
+        } else if (argc != 4) {
+            fprintf(stderr, "Usage: ./main extract <index_file> <csv_file> [--since <generation>]\n");
             exit(EXIT_FAILURE);
         }
         printf("extracting data from index file...\n");
@@ -167,7 +294,12 @@ int main(int argc, char *argv[]) {
 
         // extract the data to the csv file
         const char *csv_file = argv[3];
-        int result = bt_extract(tree, csv_file);
+        int result = since_given ? bt_extract_since(tree, csv_file, since) : bt_extract(tree, csv_file);
+        if (result == ERROR_UNSUPPORTED) {
+            fprintf(stderr, "Error: --since is not supported for sharded indexes\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
         if (result != SUCCESS) {
             fprintf(stderr, "Error: Failed to extract data to CSV file\n");
             bt_close(tree);
@@ -177,9 +309,206 @@ int main(int argc, char *argv[]) {
         // close the b-tree
         bt_close(tree);
     }
+    else if (strcmp(command, "bloom") == 0) {
+        if (argc != 3 && argc != 4) {
+            fprintf(stderr, "Usage: ./main bloom <index_file> [bits_per_key]\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // build the filter from the current contents
+        uint64_t bits = (argc == 4) ? strtoull(argv[3], NULL, 10) : BLOOM_DEFAULT_BITS;
+        if (bt_enable_bloom(tree, bits) != SUCCESS) {
+            fprintf(stderr, "Error: Failed to build bloom filter\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print success message
+        printf("bloom filter built with %llu bits per key\n", (unsigned long long)bits);
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "vindex") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Usage: ./main vindex <index_file>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // build the secondary from the current contents
+        if (bt_enable_value_index(tree) != SUCCESS) {
+            fprintf(stderr, "Error: Failed to build value index\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print success message
+        printf("value index built\n");
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "count") == 0) {
+        if (argc != 5) {
+            fprintf(stderr, "Usage: ./main count <index_file> <low_key> <high_key>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // count the keys in the inclusive range
+        uint64_t low = strtoull(argv[3], NULL, 10);
+        uint64_t high = strtoull(argv[4], NULL, 10);
+        uint64_t count = 0;
+        int result = bt_count_range(tree, low, high, &count);
+        if (result == ERROR_UNSUPPORTED) {
+            fprintf(stderr, "Error: index was not created with --counted\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print the count
+        printf("%llu keys in range\n", (unsigned long long)count);
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "rank") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: ./main rank <index_file> <key>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // count the keys smaller than the given key
+        uint64_t key = strtoull(argv[3], NULL, 10);
+        uint64_t rank = 0;
+        int result = bt_rank(tree, key, &rank);
+        if (result == ERROR_UNSUPPORTED) {
+            fprintf(stderr, "Error: index was not created with --counted\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print the rank
+        printf("rank of key %llu is %llu\n", (unsigned long long)key, (unsigned long long)rank);
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "select") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: ./main select <index_file> <position>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // find the entry at the 0-based position
+        uint64_t k = strtoull(argv[3], NULL, 10);
+        uint64_t key = 0, value = 0;
+        int result = bt_select(tree, k, &key, &value);
+        if (result == ERROR_UNSUPPORTED) {
+            fprintf(stderr, "Error: index was not created with --counted\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        } else if (result == ERROR_KEY_NOT_FOUND) {
+            printf("position past the last key\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // print the entry
+        printf("key %llu with value %llu\n", (unsigned long long)key, (unsigned long long)value);
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "freeze") == 0) {
+        if (argc != 4) {
+            fprintf(stderr, "Usage: ./main freeze <index_file> <snapshot_file>\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open the b-tree
+        BTree *tree = bt_open(index_file_path);
+        if (tree == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // write the read-only snapshot
+        int result = bt_freeze(tree, argv[3]);
+        if (result == ERROR_FILE_EXISTS) {
+            fprintf(stderr, "Error: snapshot file already exists\n");
+            bt_close(tree);
+            exit(EXIT_FAILURE);
+        }
+
+        // close the b-tree
+        bt_close(tree);
+    }
+    else if (strcmp(command, "merge") == 0) {
+        // parse the duplicate key policy
+        int policy = BT_MERGE_BOTH;
+        if (argc == 6 && strcmp(argv[5], "--policy=first") == 0) {
+            policy = BT_MERGE_FIRST;
+        } else if (argc == 6 && strcmp(argv[5], "--policy=second") == 0) {
+            policy = BT_MERGE_SECOND;
+        } else if (argc != 5 && !(argc == 6 && strcmp(argv[5], "--policy=both") == 0)) {
+            fprintf(stderr, "Usage: ./main merge <index_file> <other_index_file> <output_file> [--policy=both|first|second]\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // open both inputs
+        BTree *a = bt_open(index_file_path);
+        BTree *b = bt_open(argv[3]);
+        if (a == NULL || b == NULL) {
+            fprintf(stderr, "Error: Failed to open b-tree\n");
+            exit(EXIT_FAILURE);
+        }
+
+        // stream both into the new index
+        int result = bt_merge(a, b, argv[4], policy);
+        if (result == ERROR_FILE_EXISTS) {
+            fprintf(stderr, "Error: output file already exists\n");
+            bt_close(a);
+            bt_close(b);
+            exit(EXIT_FAILURE);
+        }
+
+        // close the inputs
+        bt_close(a);
+        bt_close(b);
+    }
     else {
         fprintf(stderr, "Usage: ./main <command> <index_file> [arguments]\n");
-        fprintf(stderr, "Valid commands: create, insert, search, load, print, extract\n");
+        fprintf(stderr, "Valid commands: create, insert, upsert, search, load, print, extract, bloom, count, rank, select, freeze, merge, search-value, vindex\n");
         exit(EXIT_FAILURE);
     }
 
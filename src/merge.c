@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Streaming merge
+ *
+ * Two indexes are merged by reading both with cursors, in key order, and
+ * feeding the merged sequence to a bottom-up build of a new tree. The build
+ * fills one node per level at a time: a full leaf is closed by the next
+ * pair, which moves up into the level above as the separator in front of
+ * the next leaf, and internal levels fill the same way. Nodes are written
+ * as soon as they are complete, so the inputs are read once and the output
+ * is written once, front to back, without ever descending the new tree.
+ *
+ * Each level holds back its last complete node. When the input ends, the
+ * last node of a level may hold only a few entries, so it is balanced with
+ * the held-back node before both are handed to the level above.
+ */
+
+// node being built at one level of the tree
+typedef struct {
+    BTNode   open;          // node being filled
+    BTNode   prev;          // last full node, written once the level moves on
+    int      has_prev;
+    uint64_t sep_key;       // entry between prev and open, moves up with prev
+    uint64_t sep_value;
+} Level;
+
+// state of a bottom-up build
+typedef struct {
+    BTree   *t;
+    Level   *levels;        // leaves first
+    int      depth;
+    int      cap;
+} Builder;
+
+// helper to start a new level, the leaf level takes the root block of the
+// empty tree so no block is wasted
+static void add_level(Builder *b) {
+    if (b->depth == b->cap) {
+        b->cap = b->cap ? b->cap * 2 : 8;
+        b->levels = realloc(b->levels, b->cap * sizeof(Level));
+        if (!b->levels) die("realloc");
+    }
+    Level *lv = &b->levels[b->depth];
+    memset(lv, 0, sizeof(*lv));
+    lv->open.block_id = b->depth == 0 ? b->t->hdr.root_block : alloc_node(b->t);
+    b->depth++;
+}
+
+// helper to write a complete node and append it as the last child of the
+// node being filled one level up
+static void add_child(Builder *b, int level, BTNode *node) {
+    if (level == b->depth) add_level(b);
+    BTNode *parent = &b->levels[level].open;
+
+    parent->children[parent->n] = node->block_id;
+    parent->counts[parent->n] = node_total(node);
+    node->parent_id = parent->block_id;
+    write_node(b->t, node->block_id, node);
+}
+
+// helper to append an entry to a level, closing its node when it is full
+static void add_entry(Builder *b, int level, uint64_t key, uint64_t value) {
+    Level *lv = &b->levels[level];
+    int max_keys = level == 0 ? b->t->leaf_max_keys : b->t->max_keys;
+
+    if (lv->open.n < max_keys) {
+        lv->open.keys[lv->open.n] = key;
+        lv->open.values[lv->open.n] = value;
+        lv->open.n++;
+        return;
+    }
+
+    // the full node is held back and the entry separates it from the next;
+    // the node held back before it is final now and moves up
+    if (lv->has_prev) {
+        uint64_t sep_key = lv->sep_key, sep_value = lv->sep_value;
+        add_child(b, level + 1, &lv->prev);
+        add_entry(b, level + 1, sep_key, sep_value);
+        lv = &b->levels[level];
+    }
+    lv->prev = lv->open;
+    lv->has_prev = 1;
+    lv->sep_key = key;
+    lv->sep_value = value;
+    memset(&lv->open, 0, sizeof(lv->open));
+    lv->open.block_id = alloc_node(b->t);
+}
+
+// helper to even out a short last node with the full node before it,
+// rotating entries (and children) through the separator; returns 1 if
+// anything moved
+static int balance(BTree *t, Level *lv, int leaf) {
+    BTNode *left = &lv->prev, *right = &lv->open;
+    int min_keys = (leaf ? t->leaf_max_keys : t->max_keys) / 2;
+    if (right->n >= min_keys) return 0;
+
+    // lay both nodes and the separator out in key order
+    uint64_t keys[2 * MAX_CHILDREN], values[2 * MAX_CHILDREN];
+    uint64_t children[2 * MAX_CHILDREN], counts[2 * MAX_CHILDREN];
+    int total = left->n + 1 + right->n;
+    memcpy(keys, left->keys, left->n * sizeof(uint64_t));
+    memcpy(values, left->values, left->n * sizeof(uint64_t));
+    keys[left->n] = lv->sep_key;
+    values[left->n] = lv->sep_value;
+    memcpy(keys + left->n + 1, right->keys, right->n * sizeof(uint64_t));
+    memcpy(values + left->n + 1, right->values, right->n * sizeof(uint64_t));
+    if (!leaf) {
+        memcpy(children, left->children, (left->n + 1) * sizeof(uint64_t));
+        memcpy(counts, left->counts, (left->n + 1) * sizeof(uint64_t));
+        memcpy(children + left->n + 1, right->children, (right->n + 1) * sizeof(uint64_t));
+        memcpy(counts + left->n + 1, right->counts, (right->n + 1) * sizeof(uint64_t));
+    }
+
+    // split them again around the middle entry
+    int n = total / 2;
+    left->n = n;
+    right->n = total - n - 1;
+    memcpy(left->keys, keys, n * sizeof(uint64_t));
+    memcpy(left->values, values, n * sizeof(uint64_t));
+    lv->sep_key = keys[n];
+    lv->sep_value = values[n];
+    memcpy(right->keys, keys + n + 1, right->n * sizeof(uint64_t));
+    memcpy(right->values, values + n + 1, right->n * sizeof(uint64_t));
+    if (!leaf) {
+        memcpy(left->children, children, (n + 1) * sizeof(uint64_t));
+        memcpy(left->counts, counts, (n + 1) * sizeof(uint64_t));
+        memcpy(right->children, children + n + 1, (right->n + 1) * sizeof(uint64_t));
+        memcpy(right->counts, counts + n + 1, (right->n + 1) * sizeof(uint64_t));
+    }
+    return 1;
+}
+
+// helper to write every node still held by the levels, bottom up, and
+// make the single node left at the top the root
+static void finish(Builder *b) {
+    for (int level = 0; level < b->depth; level++) {
+        Level *lv = &b->levels[level];
+
+        // a level that never closed a node is the top of the tree
+        if (!lv->has_prev) {
+            lv->open.parent_id = 0;
+            write_node(b->t, lv->open.block_id, &lv->open);
+            b->t->hdr.root_block = lv->open.block_id;
+            return;
+        }
+
+        int moved = balance(b->t, lv, level == 0);
+        uint64_t sep_key = lv->sep_key, sep_value = lv->sep_value;
+        add_child(b, level + 1, &lv->prev);
+        add_entry(b, level + 1, sep_key, sep_value);
+        lv = &b->levels[level];
+        add_child(b, level + 1, &lv->open);
+
+        // children that moved from the held-back node were written with
+        // their old parent
+        if (moved && level > 0) adopt_children(b->t, &lv->open);
+    }
+}
+
+// helper to advance a cursor, remembering whether it ran out
+static int next_pair(BTCursor *c, int *more, uint64_t *key, uint64_t *value) {
+    *more = bt_cursor_next(c, key, value) == SUCCESS;
+    return *more;
+}
+
+int merge_write(BTree *a, BTree *b, const char *path, int policy) {
+    if (io_file_exists(path)) return ERROR_FILE_EXISTS;
+
+    // the output keeps the node layout and options of the first input; hash
+    // indexes, snapshots and sharded indexes produce a single B-tree
+    uint64_t flags = a->hdr.flags & (BT_FLAG_COW | BT_FLAG_COUNTED | BT_FLAG_BUFFERED |
+                                     BT_FLAG_BLOOM | BT_FLAG_DIRECT | BT_FLAG_VALUES);
+    BTree *t = bt_create(path, flags);
+    if (flags & BT_FLAG_BLOOM) t->hdr.bloom_bits = a->hdr.bloom_bits;
+    if (flags & BT_FLAG_DIRECT) bt_set_cache_size(t, a->hdr.cache_blocks);
+
+    // other processes may already have opened the new file
+    lock_enter(t, 1);
+
+    // nodes are stamped with the first generation of the new file
+    t->modified = 1;
+    if (!(flags & BT_FLAG_COW)) begin_write(t);
+
+    Builder builder = { t, NULL, 0, 0 };
+    add_level(&builder);
+
+    // walk both inputs in key order, resolving keys present in both
+    BTCursor *ca = bt_cursor_open(a), *cb = bt_cursor_open(b);
+    uint64_t ka, va, kb, vb;
+    int more_a, more_b;
+    uint64_t from_a = 0, from_b = 0, dropped = 0;
+    next_pair(ca, &more_a, &ka, &va);
+    next_pair(cb, &more_b, &kb, &vb);
+    while (more_a || more_b) {
+        if (!more_b || (more_a && ka < kb)) {
+            add_entry(&builder, 0, ka, va);
+            from_a++;
+            next_pair(ca, &more_a, &ka, &va);
+        } else if (!more_a || kb < ka) {
+            add_entry(&builder, 0, kb, vb);
+            from_b++;
+            next_pair(cb, &more_b, &kb, &vb);
+        } else {
+            // every copy of the key on each side, the first input first
+            uint64_t key = ka;
+            do {
+                if (policy != BT_MERGE_SECOND) {
+                    add_entry(&builder, 0, ka, va);
+                    from_a++;
+                } else {
+                    dropped++;
+                }
+            } while (next_pair(ca, &more_a, &ka, &va) && ka == key);
+            do {
+                if (policy != BT_MERGE_FIRST) {
+                    add_entry(&builder, 0, kb, vb);
+                    from_b++;
+                } else {
+                    dropped++;
+                }
+            } while (next_pair(cb, &more_b, &kb, &vb) && kb == key);
+        }
+    }
+    bt_cursor_close(ca);
+    bt_cursor_close(cb);
+    finish(&builder);
+    free(builder.levels);
+
+    // copy-on-write files publish the whole build as one commit
+    if (flags & BT_FLAG_COW) {
+        t->hdr.generation++;
+        if (io_write_header(t->fd, &t->hdr) < 0) die("io_write_header");
+    }
+
+    // size the filter for the merged data, and index its values, since the
+    // build bypasses the insert path that maintains both
+    if (flags & BT_FLAG_BLOOM) bloom_rebuild(t);
+    if (flags & BT_FLAG_VALUES) vindex_build(t);
+    lock_leave(t);
+
+    printf("Merged %llu key-value pairs (%llu from the first index, %llu from the second, "
+           "%llu duplicates dropped) into %llu blocks\n",
+           (unsigned long long)(from_a + from_b), (unsigned long long)from_a,
+           (unsigned long long)from_b, (unsigned long long)dropped,
+           (unsigned long long)(t->hdr.next_free_block - 1));
+    bt_close(t);
+    return SUCCESS;
+}
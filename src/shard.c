@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btree_internal.h"
+#include "io.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Sharded index
+ *
+ * The index file is a manifest: a header with BT_FLAG_SHARDED and the
+ * number of shards, but no tree. Shard i is an ordinary B-tree file named
+ * <index>.shard<i> with the manifest's other flags. Keys are routed by
+ * hash, so all copies of a key live in the same shard; loads build the
+ * shards in parallel, one thread per shard, each on its own file.
+ */
+
+// pairs waiting to be merged into one shard (work of one loader thread)
+typedef struct {
+    BTree    *shard;
+    uint64_t *keys;
+    uint64_t *values;
+    size_t    count;
+    size_t    cap;
+} ShardLoad;
+
+// input being split by shard
+typedef struct {
+    BTree     *t;
+    ShardLoad *loads;
+} Partition;
+
+// helper to build the path of a shard file
+static void shard_path(BTree *t, uint64_t i, char *buf, size_t size) {
+    snprintf(buf, size, "%s.shard%llu", t->path, (unsigned long long)i);
+}
+
+// helper to pick the shard of a key (Fibonacci hashing)
+static uint64_t shard_index(BTree *t, uint64_t key) {
+    return ((key * 0x9e3779b97f4a7c15ULL) >> 32) % t->hdr.shard_count;
+}
+
+void shard_create(BTree *t) {
+    t->shards = calloc(t->hdr.shard_count, sizeof(BTree *));
+    if (!t->shards) die("calloc");
+
+    // every shard gets the manifest's mode, minus the sharding itself
+    uint64_t flags = t->hdr.flags & ~(uint64_t)BT_FLAG_SHARDED;
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        char path[4096];
+        shard_path(t, i, path, sizeof(path));
+        t->shards[i] = bt_create(path, flags);
+    }
+}
+
+void shard_open(BTree *t) {
+    if (t->hdr.shard_count == 0) die("invalid shard manifest");
+    t->shards = calloc(t->hdr.shard_count, sizeof(BTree *));
+    if (!t->shards) die("calloc");
+
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        char path[4096];
+        shard_path(t, i, path, sizeof(path));
+        t->shards[i] = bt_open(path);
+    }
+}
+
+void shard_close(BTree *t) {
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) bt_close(t->shards[i]);
+    free(t->shards);
+    t->shards = NULL;
+}
+
+BTree* shard_route(BTree *t, uint64_t key) {
+    return t->shards[shard_index(t, key)];
+}
+
+// helper to queue a pair for its shard (csv callback)
+static int partition_pair(void *ctx, uint64_t key, uint64_t value) {
+    Partition *part = ctx;
+    ShardLoad *load = &part->loads[shard_index(part->t, key)];
+
+    if (load->count == load->cap) {
+        load->cap = load->cap ? load->cap * 2 : 1024;
+        load->keys = realloc(load->keys, load->cap * sizeof(uint64_t));
+        load->values = realloc(load->values, load->cap * sizeof(uint64_t));
+        if (!load->keys || !load->values) die("realloc");
+    }
+    load->keys[load->count] = key;
+    load->values[load->count] = value;
+    load->count++;
+    return SUCCESS;
+}
+
+// helper to set up one pending batch per shard
+static ShardLoad* shard_loads(BTree *t) {
+    ShardLoad *loads = calloc(t->hdr.shard_count, sizeof(ShardLoad));
+    if (!loads) die("calloc");
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) loads[i].shard = t->shards[i];
+    return loads;
+}
+
+// helper to free the pending batches
+static void free_loads(BTree *t, ShardLoad *loads) {
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        free(loads[i].keys);
+        free(loads[i].values);
+    }
+    free(loads);
+}
+
+int shard_insert_batch(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count) {
+    ShardLoad *loads = shard_loads(t);
+    Partition part = { t, loads };
+    for (size_t i = 0; i < count; i++) partition_pair(&part, keys[i], values[i]);
+
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        bt_insert_batch(loads[i].shard, loads[i].keys, loads[i].values, loads[i].count);
+    }
+    free_loads(t, loads);
+    return SUCCESS;
+}
+
+// loader thread: merge a shard's pairs into its own file
+static void* load_shard(void *arg) {
+    ShardLoad *load = arg;
+    bt_insert_batch(load->shard, load->keys, load->values, load->count);
+
+    // resize the filter for the loaded data
+    if ((load->shard->hdr.flags & BT_FLAG_BLOOM) && load->count > 0) bloom_rebuild(load->shard);
+
+    // the ring belongs to this thread
+    io_batch_shutdown();
+    return NULL;
+}
+
+int shard_load(BTree *t, const char *csv_file) {
+    uint64_t n = t->hdr.shard_count;
+
+    ShardLoad *loads = shard_loads(t);
+    pthread_t *threads = calloc(n, sizeof(pthread_t));
+    if (!threads) die("calloc");
+
+    // split the input by shard
+    Partition part = { t, loads };
+    int success_count = csv_for_each(csv_file, partition_pair, &part);
+    if (success_count < 0) {
+        free(threads);
+        free_loads(t, loads);
+        return -1;
+    }
+
+    // build the shards in parallel, one thread per file
+    for (uint64_t i = 0; i < n; i++) {
+        if (pthread_create(&threads[i], NULL, load_shard, &loads[i]) != 0) die("pthread_create");
+    }
+    for (uint64_t i = 0; i < n; i++) pthread_join(threads[i], NULL);
+    free(threads);
+    free_loads(t, loads);
+
+    // print summary and return success
+    printf("Loaded %d key-value pairs from CSV file into %llu shards\n",
+           success_count, (unsigned long long)n);
+    return SUCCESS;
+}
+
+void shard_enter_all(BTree *t) {
+    // shards are always taken in the same order, and only shared
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) lock_enter(t->shards[i], 0);
+}
+
+void shard_leave_all(BTree *t) {
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) lock_leave(t->shards[i]);
+}
+
+uint64_t shard_count_below(BTree *t, uint64_t key, int inclusive) {
+    // the shards split the keys, so their counts add up
+    uint64_t count = 0;
+    for (uint64_t i = 0; i < t->hdr.shard_count; i++) {
+        count += tree_count_below(t->shards[i], key, inclusive);
+    }
+    return count;
+}
+
+int shard_select(BTree *t, uint64_t k, uint64_t *key, uint64_t *value) {
+    // the whole search works on one version of every shard
+    shard_enter_all(t);
+    if (k >= shard_count_below(t, UINT64_MAX, 1)) {
+        shard_leave_all(t);
+        return ERROR_KEY_NOT_FOUND;
+    }
+
+    // binary search for the smallest key with more than k entries up to it
+    uint64_t low = 0, high = UINT64_MAX;
+    while (low < high) {
+        uint64_t mid = low + (high - low) / 2;
+        if (shard_count_below(t, mid, 1) > k) high = mid;
+        else low = mid + 1;
+    }
+
+    // all copies of that key live in one shard, pick the right one of them
+    BTree *shard = shard_route(t, low);
+    uint64_t below = shard_count_below(t, low, 0);
+    uint64_t shard_below = tree_count_below(shard, low, 0);
+    int result = tree_select(shard, shard_below + (k - below), key, value);
+    shard_leave_all(t);
+    return result;
+}
@@ -39,4 +39,15 @@ uint64_t be64_to_host(uint64_t x) {
         return x;
     }
     return reverse_bytes(x);
-}
\ No newline at end of file
+}
+
+uint64_t get64(const uint8_t *buf, size_t off) {
+    uint64_t temp;
+    memcpy(&temp, buf + off, sizeof(temp));
+    return be64_to_host(temp);
+}
+
+void put64(uint8_t *buf, size_t off, uint64_t value) {
+    uint64_t temp = host_to_be64(value);
+    memcpy(buf + off, &temp, sizeof(temp));
+}
@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -40,4 +41,20 @@ uint64_t host_to_be64(uint64_t x);
  */ 
 uint64_t be64_to_host(uint64_t x);
 
+/**
+ * Read a big-endian 64-bit word of a buffer
+ * @param buf the buffer
+ * @param off byte offset of the word (need not be aligned)
+ * @return  the word in host byte order
+ */ 
+uint64_t get64(const uint8_t *buf, size_t off);
+
+/**
+ * Store a 64-bit word in a buffer in big endian
+ * @param buf   the buffer
+ * @param off   byte offset of the word (need not be aligned)
+ * @param value the word in host byte order
+ */ 
+void put64(uint8_t *buf, size_t off, uint64_t value);
+
 #endif /* UTILS_H */
\ No newline at end of file
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "btree_internal.h"
+#include "constants.h"
+#include "utils.h"
+
+/**
+ * Secondary value index
+ *
+ * An index created with BT_FLAG_VALUES keeps a second B-tree in the
+ * companion file <index>.vidx. Its keys are the values of the primary tree
+ * and its values are the primary keys, so the copies of a value are found
+ * with one descent. Every write adds the reversed pair to the secondary
+ * before it changes the primary, and loads add each batch with a single
+ * batch merge. The secondary therefore holds at least every pair of the
+ * primary: a crash between the two writes, or an upsert that replaces a
+ * value, can only leave extra entries. A lookup by value checks each key it
+ * finds against the primary and drops the keys whose pair is gone.
+ * Rebuilding the secondary from the primary removes the extra entries.
+ */
+
+// primary pair being looked for (scan callback context)
+typedef struct {
+    uint64_t value;
+    int      found;
+} PairCheck;
+
+// pair of the primary, reversed for the secondary
+typedef struct {
+    uint64_t value;
+    uint64_t key;
+} ValuePair;
+
+// helper to build the path of the companion file
+static void vindex_path(BTree *t, char *buf, size_t size) {
+    snprintf(buf, size, "%s.vidx", t->path);
+}
+
+// helper to append the primary key of a secondary pair to a list (scan
+// callback)
+static void collect_key(void *ctx, uint64_t value, uint64_t key) {
+    key_list_add(ctx, key);
+}
+
+// helper to note a copy of the key with the wanted value (scan callback)
+static void check_pair(void *ctx, uint64_t key, uint64_t value) {
+    PairCheck *check = ctx;
+    if (value == check->value) check->found = 1;
+}
+
+// helper to order reversed pairs by value, then key
+static int compare_value_pairs(const void *a, const void *b) {
+    const ValuePair *x = a, *y = b;
+    if (x->value != y->value) return x->value < y->value ? -1 : 1;
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+// helper to check whether the primary holds a pair
+static int primary_has(BTree *t, uint64_t key, uint64_t value) {
+    // hash indexes hold one copy per key
+    if (t->hdr.flags & BT_FLAG_HASH) {
+        uint64_t found;
+        return hash_search(t, key, &found) == SUCCESS && found == value;
+    }
+
+    // buffered copies may still have messages waiting above them
+    PairCheck check = { value, 0 };
+    if (t->hdr.flags & BT_FLAG_BUFFERED) buffer_scan_key(t, key, check_pair, &check);
+    else tree_scan_key(t, key, check_pair, &check);
+    return check.found;
+}
+
+void vindex_create(BTree *t) {
+    char path[4096];
+    vindex_path(t, path, sizeof(path));
+
+    // a file left over from an earlier index of the same name is replaced
+    unlink(path);
+
+    // readers of a copy-on-write primary get snapshots of the secondary too
+    t->vindex = bt_create(path, t->hdr.flags & (BT_FLAG_COW | BT_FLAG_DIRECT));
+}
+
+void vindex_open(BTree *t) {
+    char path[4096];
+    vindex_path(t, path, sizeof(path));
+    if (io_file_exists(path)) t->vindex = bt_open(path);
+    else vindex_build(t);
+}
+
+void vindex_close(BTree *t) {
+    if (t->vindex) bt_close(t->vindex);
+    t->vindex = NULL;
+}
+
+void vindex_add(BTree *t, uint64_t key, uint64_t value) {
+    bt_insert(t->vindex, value, key);
+}
+
+void vindex_add_batch(BTree *t, const uint64_t *keys, const uint64_t *values, size_t count) {
+    bt_insert_batch(t->vindex, values, keys, count);
+}
+
+void vindex_build(BTree *t) {
+    // no other process writes the primary while the secondary is rebuilt
+    lock_enter(t, 1);
+
+    // collect the primary pairs reversed, sorted so the batch keeps the
+    // copies of a value in key order
+    ValuePair *pairs = NULL;
+    size_t count = 0, cap = 0;
+    BTCursor *cursor = bt_cursor_open(t);
+    uint64_t key, value;
+    while (bt_cursor_next(cursor, &key, &value) == SUCCESS) {
+        if (count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            pairs = realloc(pairs, cap * sizeof(ValuePair));
+            if (!pairs) die("realloc");
+        }
+        pairs[count].value = value;
+        pairs[count].key = key;
+        count++;
+    }
+    bt_cursor_close(cursor);
+    qsort(pairs, count, sizeof(ValuePair), compare_value_pairs);
+
+    // start over from an empty secondary
+    vindex_close(t);
+    vindex_create(t);
+
+    uint64_t *keys = malloc((count + 1) * sizeof(uint64_t));
+    uint64_t *values = malloc((count + 1) * sizeof(uint64_t));
+    if (!keys || !values) die("malloc");
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = pairs[i].key;
+        values[i] = pairs[i].value;
+    }
+    free(pairs);
+    vindex_add_batch(t, keys, values, count);
+    free(keys);
+    free(values);
+    lock_leave(t);
+}
+
+int vindex_search(BTree *t, uint64_t value, uint64_t **keys, size_t *count) {
+    // the writer changes both trees within one operation on the primary
+    lock_enter(t, 0);
+
+    // the candidates are every key the secondary lists for the value
+    KeyList list = {0};
+    lock_enter(t->vindex, 0);
+    tree_scan_key(t->vindex, value, collect_key, &list);
+    lock_leave(t->vindex);
+    qsort(list.keys, list.count, sizeof(uint64_t), compare_keys);
+
+    // keep each key once, and only if the primary still has the pair
+    size_t kept = 0;
+    uint64_t prev = 0;
+    for (size_t i = 0; i < list.count; i++) {
+        uint64_t key = list.keys[i];
+        if (i > 0 && key == prev) continue;
+        prev = key;
+        if (primary_has(t, key, value)) list.keys[kept++] = key;
+    }
+    lock_leave(t);
+
+    *keys = list.keys;
+    *count = kept;
+    return kept > 0 ? SUCCESS : ERROR_KEY_NOT_FOUND;
+}
@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "btree.h"
+#include "constants.h"
+
+/**
+ * Regression tests for sequences of calls on one handle, which the command
+ * line tool cannot reproduce since it opens the index once per command.
+ * Run them with `make test`.
+ */
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        failures++; \
+    } \
+} while (0)
+
+// helper to build a scratch path and remove what an earlier run left there
+static void scratch_path(char *buf, size_t size, const char *name) {
+    snprintf(buf, size, "/tmp/btree_test_%d_%s.idx", (int)getpid(), name);
+    const char *sidecars[] = { "", ".hot", ".bloom", ".vidx",
+                               ".shard0", ".shard0.hot", ".shard1", ".shard1.hot" };
+    for (size_t i = 0; i < sizeof(sidecars) / sizeof(sidecars[0]); i++) {
+        char path[4200];
+        snprintf(path, sizeof(path), "%s%s", buf, sidecars[i]);
+        remove(path);
+    }
+}
+
+// helper to check that a cursor returns exactly the given keys, in order
+static void check_keys(BTree *t, const uint64_t *keys, size_t count) {
+    BTCursor *c = bt_cursor_open(t);
+    uint64_t key, value;
+    size_t n = 0;
+    while (bt_cursor_next(c, &key, &value) == SUCCESS) {
+        CHECK(n < count && key == keys[n]);
+        n++;
+    }
+    bt_cursor_close(c);
+    CHECK(n == count);
+}
+
+// an upsert of a new largest key must not leave the append path with a
+// stale maximum
+static void test_append_after_upsert(void) {
+    char path[4096];
+    scratch_path(path, sizeof(path), "append");
+    BTree *t = bt_create(path, 0);
+    CHECK(t != NULL);
+
+    CHECK(bt_insert(t, 10, 1) == SUCCESS);
+    CHECK(bt_insert(t, 20, 2) == SUCCESS);
+    CHECK(bt_insert(t, 30, 3) == SUCCESS);
+    CHECK(bt_upsert(t, 100, 4) == SUCCESS);
+    CHECK(bt_insert(t, 50, 5) == SUCCESS);
+
+    uint64_t keys[] = { 10, 20, 30, 50, 100 };
+    check_keys(t, keys, 5);
+    uint64_t value = 0;
+    CHECK(bt_search(t, 50, &value) == SUCCESS && value == 5);
+
+    bt_close(t);
+    scratch_path(path, sizeof(path), "append");
+}
+
+// a batch merge must not leave the append path with a stale maximum, here
+// in the value index, which is a tree of its own
+static void test_value_index_after_batch(void) {
+    char path[4096];
+    scratch_path(path, sizeof(path), "values");
+    BTree *t = bt_create(path, BT_FLAG_VALUES);
+    CHECK(t != NULL);
+
+    uint64_t batch_key = 2, batch_value = 100;
+    CHECK(bt_insert(t, 1, 10) == SUCCESS);
+    CHECK(bt_insert_batch(t, &batch_key, &batch_value, 1) == SUCCESS);
+    CHECK(bt_insert(t, 3, 50) == SUCCESS);
+
+    uint64_t *keys = NULL;
+    size_t count = 0;
+    CHECK(bt_search_value(t, 50, &keys, &count) == SUCCESS && count == 1 && keys[0] == 3);
+    free(keys);
+
+    bt_close(t);
+    scratch_path(path, sizeof(path), "values");
+}
+
+// counts on a sharded index must see what another handle wrote to every
+// shard, even if the reader looked at none of them in between
+static void test_sharded_counts_follow_writer(void) {
+    char path[4096];
+    scratch_path(path, sizeof(path), "shards");
+    BTree *writer = bt_create_sharded(path, BT_FLAG_COUNTED, 2);
+    CHECK(writer != NULL);
+    for (uint64_t k = 1; k <= 100; k++) CHECK(bt_insert(writer, k, k) == SUCCESS);
+
+    BTree *reader = bt_open(path);
+    CHECK(reader != NULL);
+    uint64_t count = 0, rank = 0, key = 0;
+    CHECK(bt_count_range(reader, 0, UINT64_MAX, &count) == SUCCESS && count == 100);
+
+    for (uint64_t k = 101; k <= 2000; k++) CHECK(bt_insert(writer, k, k) == SUCCESS);
+    CHECK(bt_count_range(reader, 0, UINT64_MAX, &count) == SUCCESS && count == 2000);
+    CHECK(bt_rank(reader, UINT64_MAX, &rank) == SUCCESS && rank == 2000);
+    CHECK(bt_select(reader, 1999, &key, NULL) == SUCCESS && key == 2000);
+
+    bt_close(reader);
+    bt_close(writer);
+    scratch_path(path, sizeof(path), "shards");
+}
+
+int main(void) {
+    test_append_after_upsert();
+    test_value_index_after_batch();
+    test_sharded_counts_follow_writer();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("all tests passed\n");
+    return 0;
+}